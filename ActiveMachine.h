@@ -0,0 +1,113 @@
+// Copyright 2016, Jason Conaway
+// ActiveMachine pairs a state machine with an event queue (its mailbox), so
+// that events can be posted from any thread and dispatched later, one at a
+// time. It can be run by a Scheduler, or by calling Run directly.
+//
+// Machines should message each other by posting to each other's ActiveMachine,
+// rather than calling HandeleEvent on each other from their actions. Posting
+// never re-enters the receiver, so cycles of messages cannot deadlock or
+// overflow the stack; the receiver handles the event in its next time slot.
+//
+// With ingress filtering, posted events that the machine's last committed
+// state doesn't handle are discarded instead of queued (see EnabledEvents).
+// The state may change before a queued event is dispatched, so only filter
+// machines whose events are irrelevant unless they can be handled right away,
+// like raw input. Bind a graph to the machine to make filtering O(1).
+#pragma once
+
+#include "EventQueue.h"
+#include "Scheduler.h"
+#include "SignalInbox.h"
+#include "StateMachine.h"
+
+#include <cstddef>
+#include <memory>
+
+namespace LeanHsm
+{
+
+template<typename EventType>
+class ActiveMachine : public ActiveObject
+{
+public:
+	using Hsm = StateMachine<EventType>;
+
+	ActiveMachine(Hsm& sm, size_t queueCapacity, QueuePolicy policy = QueuePolicy::Reject)
+		: mMachine(sm), mQueue(queueCapacity, policy) {}
+
+	// Queues an event for the machine, along with its payload (if any),
+	// according to the queue's policy. May be called from any thread.
+	// Higher priority events are dispatched first. An event with a payload
+	// is dropped if the state defers it (see HandleEventWithPayload).
+	PostResult Post(const EventType& e, Priority priority, Payload payload = Payload())
+	{
+		auto result = mFilterIngress
+			? mQueue.PostAccepted(e, mMachine.EnabledEventsSnapshot(), priority, std::move(payload))
+			: mQueue.Post(e, priority, std::move(payload));
+		if (result == PostResult::Accepted || result == PostResult::DroppedOldest)
+		{
+			Notify();
+		}
+		return result;
+	}
+	PostResult Post(const EventType& e, Payload payload = Payload())
+	{
+		return Post(e, Priority::Normal, std::move(payload));
+	}
+
+	// Turns ingress filtering on or off. Call this before posting events.
+	void FilterIngress(bool enabled) { mFilterIngress = enabled; }
+
+	// Allows events to be posted with PostFromSignal. This allocates, so it
+	// must be called from a normal context, before any events are posted.
+	void EnableSignalPosting() { mSignals.reset(new SignalInbox<EventType>); }
+
+	// Records an event without blocking or allocating, so it is safe to call
+	// from signal handlers (see SignalInbox.h). The event is queued, with
+	// critical priority, at the start of the next Run; if the critical lane is
+	// full, it stays in the inbox until a later Run. A Scheduler runs the
+	// machine once a worker polls its signal flags (see Scheduler.h).
+	// Returns false if signal posting is not enabled.
+	bool PostFromSignal(const EventType& e)
+	{
+		if (!mSignals || !mSignals->Post(e))
+		{
+			return false;
+		}
+		NotifyFromSignal();
+		return true;
+	}
+
+	// Dispatches up to maxEvents queued events to the state machine.
+	// Payloads are released after their events are handled.
+	// Returns true if more events are queued.
+	bool Run(size_t maxEvents) override
+	{
+		if (mSignals)
+		{
+			mSignals->Take([this](const EventType& e) { return mQueue.Post(e, Priority::Critical) != PostResult::Rejected; });
+		}
+
+		Message<EventType> message;
+		for (size_t i = 0; i < maxEvents && mQueue.Pop(message); ++i)
+		{
+			mMachine.HandleEventWithPayload(message.event, message.payload.Data(), message.payload.Type());
+			message.payload.Reset();
+		}
+		return HasPending();
+	}
+
+	bool HasPending() const override { return !mQueue.Empty() || (mSignals && mSignals->HasPending()); }
+	size_t PendingCount() const override { return mQueue.SizeHint() + (mSignals ? mSignals->PendingCount() : 0); }
+
+	Hsm& Machine() const { return mMachine; }
+	QueueStats Stats() const { return mQueue.Stats(); }
+
+private:
+	Hsm& mMachine;
+	EventQueue<EventType> mQueue;
+	bool mFilterIngress{ false };
+	std::unique_ptr<SignalInbox<EventType>> mSignals;
+};
+
+} // namespace LeanHsm
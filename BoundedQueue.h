@@ -0,0 +1,133 @@
+// Copyright 2016, Jason Conaway
+// BoundedQueue is a fixed-capacity, lock-free, multi-producer/multi-consumer
+// FIFO queue. It never allocates after construction, so it is suitable for
+// passing work between threads on hot paths.
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+namespace LeanHsm
+{
+
+template<typename T>
+class BoundedQueue
+{
+public:
+	// The capacity is rounded up to a power of two.
+	explicit BoundedQueue(size_t capacity)
+	{
+		size_t size = 2;
+		while (size < capacity)
+		{
+			size <<= 1;
+		}
+		mCells.reset(new Cell[size]);
+		mMask = size - 1;
+		for (size_t i = 0; i < size; ++i)
+		{
+			mCells[i].sequence.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	BoundedQueue(const BoundedQueue&) = delete;
+	BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+	// Appends a value to the queue. Returns false if the queue is full,
+	// in which case the value is not moved from.
+	template<typename U>
+	bool TryPush(U&& value)
+	{
+		Cell* cell;
+		size_t pos = mEnqueuePos.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			cell = &mCells[pos & mMask];
+			size_t seq = cell->sequence.load(std::memory_order_acquire);
+			intptr_t diff = intptr_t(seq) - intptr_t(pos);
+			if (diff == 0)
+			{
+				if (mEnqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				{
+					break;
+				}
+			}
+			else if (diff < 0)
+			{
+				return false; // full
+			}
+			else
+			{
+				pos = mEnqueuePos.load(std::memory_order_relaxed);
+			}
+		}
+		cell->value = std::forward<U>(value);
+		cell->sequence.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Removes the oldest value from the queue. Returns false if it is empty.
+	bool TryPop(T& value)
+	{
+		Cell* cell;
+		size_t pos = mDequeuePos.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			cell = &mCells[pos & mMask];
+			size_t seq = cell->sequence.load(std::memory_order_acquire);
+			intptr_t diff = intptr_t(seq) - intptr_t(pos + 1);
+			if (diff == 0)
+			{
+				if (mDequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				{
+					break;
+				}
+			}
+			else if (diff < 0)
+			{
+				return false; // empty
+			}
+			else
+			{
+				pos = mDequeuePos.load(std::memory_order_relaxed);
+			}
+		}
+		value = std::move(cell->value);
+		cell->sequence.store(pos + mMask + 1, std::memory_order_release);
+		return true;
+	}
+
+	size_t Capacity() const { return mMask + 1; }
+
+	// Returns the number of queued values. This is only a hint while other
+	// threads are pushing or popping.
+	size_t SizeHint() const
+	{
+		size_t head = mDequeuePos.load(std::memory_order_relaxed);
+		size_t tail = mEnqueuePos.load(std::memory_order_relaxed);
+		return tail > head ? tail - head : 0;
+	}
+
+private:
+	struct Cell
+	{
+		std::atomic<size_t> sequence;
+		T value;
+	};
+
+	// Padding keeps the producer and consumer positions on separate cache lines
+	static const size_t CacheLineSize = 64;
+
+	std::unique_ptr<Cell[]> mCells;
+	size_t mMask{ 0 };
+	char mPad0[CacheLineSize];
+	std::atomic<size_t> mEnqueuePos{ 0 };
+	char mPad1[CacheLineSize];
+	std::atomic<size_t> mDequeuePos{ 0 };
+	char mPad2[CacheLineSize];
+};
+
+} // namespace LeanHsm
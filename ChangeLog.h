@@ -0,0 +1,122 @@
+// Copyright 2016, Jason Conaway
+// ChangeLog collects the state changes of many state machines, so that
+// consumers (rendering, replication, etc.) can process only the machines
+// that changed, instead of polling every machine with IsInState.
+//
+// USAGE:
+// LeanHsm::ChangeLog<Door::Event> changes(1024);
+// changes.Subscribe(door.GetStateMachine());
+// ...
+// changes.Drain([](const auto& change) { Replicate(*change.machine, *change.to); });
+// if (changes.TakeOverflowCount() > 0) { /* log was full; resync everything */ }
+//
+// Subscribed machines append to the log from whichever thread dispatches
+// their events, without locking. Only transitions that change the current
+// state are recorded; internal transitions are not. A transition between
+// submachine placements is recorded even if it keeps the state; the
+// placements are the machine's (see StateMachine::PlacementAt).
+#pragma once
+
+#include "BoundedQueue.h"
+#include "StateMachine.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <limits>
+#include <utility>
+#include <vector>
+
+namespace LeanHsm
+{
+
+template<typename EventType>
+class ChangeLog
+{
+public:
+	using Hsm = StateMachine<EventType>;
+	using State = typename Hsm::State;
+
+	struct Change
+	{
+		Hsm* machine;
+		const State* from;
+		const State* to;
+	};
+
+	explicit ChangeLog(size_t capacity) : mChanges(capacity) {}
+
+	~ChangeLog()
+	{
+		for (auto& subscription : mSubscriptions)
+		{
+			subscription.first->RemoveCommitHook(subscription.second);
+		}
+	}
+
+	ChangeLog(const ChangeLog&) = delete;
+	ChangeLog& operator=(const ChangeLog&) = delete;
+
+	// Records the state changes of the machine, until it is unsubscribed or
+	// the log is destroyed. The machine must outlive the subscription.
+	void Subscribe(Hsm& sm)
+	{
+		auto hook = sm.AddCommitHook([this, hash = sm.ConfigurationHash()](Hsm& sm, const typename Hsm::Commit& c) mutable {
+			// a transition between placements may keep the state, but not the hash
+			auto previous = hash;
+			hash = sm.ConfigurationHash();
+			if (c.from != c.to || hash != previous)
+			{
+				Append(Change{ &sm, c.from, c.to });
+			}
+		});
+		mSubscriptions.emplace_back(&sm, hook);
+	}
+
+	// Stops recording the state changes of the machine.
+	void Unsubscribe(Hsm& sm)
+	{
+		auto subscription = std::find_if(mSubscriptions.begin(), mSubscriptions.end(),
+			[&sm](const std::pair<Hsm*, typename Hsm::CommitHookId>& s) { return s.first == &sm; });
+		if (subscription != mSubscriptions.end())
+		{
+			sm.RemoveCommitHook(subscription->second);
+			mSubscriptions.erase(subscription);
+		}
+	}
+
+	// Appends a change. If the log is full, the change is dropped and counted.
+	void Append(const Change& change)
+	{
+		if (!mChanges.TryPush(change))
+		{
+			mOverflowCount.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	// Passes up to maxChanges recorded changes, oldest first, to the consumer.
+	// Returns the number of changes consumed.
+	template<typename Consumer>
+	size_t Drain(Consumer&& consumer, size_t maxChanges = std::numeric_limits<size_t>::max())
+	{
+		size_t count = 0;
+		Change change;
+		while (count < maxChanges && mChanges.TryPop(change))
+		{
+			consumer(change);
+			++count;
+		}
+		return count;
+	}
+
+	// Returns the number of changes dropped since the last call, and resets it.
+	// A non-zero result means that the consumer missed some changes.
+	size_t TakeOverflowCount() { return mOverflowCount.exchange(0, std::memory_order_relaxed); }
+
+private:
+	BoundedQueue<Change> mChanges;
+	std::atomic<size_t> mOverflowCount{ 0 };
+	std::vector<std::pair<Hsm*, typename Hsm::CommitHookId>> mSubscriptions;
+};
+
+} // namespace LeanHsm
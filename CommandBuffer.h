@@ -0,0 +1,78 @@
+// Copyright 2016, Jason Conaway
+// CommandBuffer records commands that actions emit, instead of acting on
+// shared systems (audio, logging, owner state) directly. This allows many
+// state machines to be dispatched in parallel, with one buffer per thread.
+// Afterwards, the buffers are applied on one thread, in order of instance id,
+// so the result does not depend on how the work was divided among threads.
+//
+// Actions emit commands with StateMachine::Emit, which returns false when
+// no buffer is bound. Then the action should perform the command directly.
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace LeanHsm
+{
+
+template<typename CommandType>
+class CommandBuffer
+{
+public:
+	using Command = CommandType;
+
+	void Push(uint32_t instanceId, CommandType command)
+	{
+		mEntries.push_back(Entry{ instanceId, std::move(command) });
+	}
+
+	size_t Size() const { return mEntries.size(); }
+	void Clear() { mEntries.clear(); }
+
+	// Applies the commands in each buffer, ordered by instance id, and then
+	// clears the buffers. The commands of each instance stay in the order
+	// that they were emitted.
+	template<typename Apply>
+	static void ApplyInOrder(std::vector<CommandBuffer>& buffers, Apply&& apply);
+
+private:
+	struct Entry
+	{
+		uint32_t instanceId;
+		CommandType command;
+	};
+	std::vector<Entry> mEntries;
+};
+
+template<typename CommandType>
+template<typename Apply>
+void CommandBuffer<CommandType>::ApplyInOrder(std::vector<CommandBuffer>& buffers, Apply&& apply)
+{
+	std::vector<Entry*> ordered;
+	for (auto& buffer : buffers)
+	{
+		for (auto& entry : buffer.mEntries)
+		{
+			ordered.push_back(&entry);
+		}
+	}
+
+	// buffers filled from contiguous ranges of instances are already in order
+	auto byInstance = [](const Entry* a, const Entry* b) { return a->instanceId < b->instanceId; };
+	if (!std::is_sorted(begin(ordered), end(ordered), byInstance))
+	{
+		std::stable_sort(begin(ordered), end(ordered), byInstance);
+	}
+
+	for (auto entry : ordered)
+	{
+		apply(entry->command);
+	}
+	for (auto& buffer : buffers)
+	{
+		buffer.Clear();
+	}
+}
+
+} // namespace LeanHsm
@@ -52,35 +52,53 @@ const Door::State Door::Opened
 
 /*static*/ void Door::OnEntry(Hsm& hsm)
 {
-	std::cout << "Door| entered state " << hsm.CurrentState().name << std::endl;
+	Perform(hsm, { &hsm.Owner<Door>(), std::string("entered state ") + hsm.CurrentState().name, "" });
 }
 
 /*static*/ void Door::OnExit(Hsm& hsm)
 {
-	std::cout << "Door| exited state " << hsm.CurrentState().name << std::endl;
+	Perform(hsm, { &hsm.Owner<Door>(), std::string("exited state ") + hsm.CurrentState().name, "" });
 }
 
 /*static*/ void Door::LockedLightOn(Hsm& hsm)
 {
-	std::cout << "Door| light on" << std::endl;
+	Perform(hsm, { &hsm.Owner<Door>(), "light on", "" });
 }
 
 /*static*/ void Door::LockedLightOff(Hsm& hsm)
 {
-	std::cout << "Door| light off" << std::endl;
+	Perform(hsm, { &hsm.Owner<Door>(), "light off", "" });
 }
 
 /*static*/ Door::Hsm::Action Door::PlayFx(const std::string& effectName)
 {
 	auto action = [effectName](Hsm& hsm) {
-		std::cout << "Door| playing effect '" << effectName << "'" << std::endl;
-		hsm.Owner<Door>().mCurrentEffect = effectName;
+		Perform(hsm, { &hsm.Owner<Door>(), "playing effect '" + effectName + "'", effectName });
 		return;
 	};
 
 	return action;
 }
 
+/*static*/ void Door::Perform(Hsm& hsm, Command command)
+{
+	// when replaying, only restore the effect; the output already happened
+	if (hsm.IsReplaying())
+	{
+		if (!command.effectName.empty())
+		{
+			command.door->mCurrentEffect = command.effectName;
+		}
+		return;
+	}
+
+	// Emit only takes the command when a command buffer is bound
+	if (!hsm.Emit(std::move(command)))
+	{
+		Apply(command);
+	}
+}
+
 
 ///////////////////////////////////////////////////////////////////////////////
 // Door methods
@@ -91,6 +109,15 @@ Door::Door()
 	mStateMachine.OnEntryAndExit(OnEntry, OnExit);
 }
 
+/*static*/ void Door::Apply(const Command& command)
+{
+	std::cout << "Door| " << command.message << std::endl;
+	if (!command.effectName.empty())
+	{
+		command.door->mCurrentEffect = command.effectName;
+	}
+}
+
 /*static*/ std::string Door::EventToString(Event e)
 {
 	const char* eventNames[]{ "Open", "Close", "Lock", "Unlock" };
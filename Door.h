@@ -18,12 +18,27 @@ public:
 
 	LEAN_HSM_ALIASES(Door, Event);
 
+	// Door actions emit commands when the state machine has a command buffer
+	// bound to it (i.e. when doors are dispatched in parallel), and otherwise
+	// perform them immediately.
+	struct Command
+	{
+		Door* door;
+		std::string message;
+		std::string effectName; // empty for commands that only log a message
+	};
+	using CommandBuffer = LeanHsm::CommandBuffer<Command>;
+	static void Apply(const Command& command);
+
 	Door();
 
 	bool HandleEvent(Event e) { return mStateMachine.HandeleEvent(e); }
 	bool IsInState(const State& s) const { return mStateMachine.IsInState(s); }
 	const State& GetState() const { return mStateMachine.CurrentState(); }
+	bool IsInStateSnapshot(const State& s) const { return mStateMachine.IsInStateSnapshot(s); }
+	const State& GetStateSnapshot() const { return mStateMachine.CurrentStateSnapshot(); }
 	const std::string& GetCurrentEffect() const { return mCurrentEffect; }
+	Hsm& GetStateMachine() { return mStateMachine; }
 
 	// States
 	static const State Exists;
@@ -43,6 +58,7 @@ private:
 	static void LockedLightOn(Hsm& hsm);
 	static void LockedLightOff(Hsm& hsm);
 	static Hsm::Action PlayFx(const std::string& effectName);
+	static void Perform(Hsm& hsm, Command command);
 
 	OwnedHsm mStateMachine{ *this, Exists, Log, EventToString };
 	std::string mCurrentEffect;
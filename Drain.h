@@ -0,0 +1,114 @@
+// Copyright 2016, Jason Conaway
+// Drain functions dispatch queued events within a budget, so that a burst
+// of events cannot blow a frame's time budget. They stop between events
+// (never during a transition) once the budget is spent, and report how many
+// events remain. DrainGroup does the same for many active objects, taking
+// one event from each in turn, and resumes where it left off on the next call.
+//
+// USAGE:
+// LeanHsm::DrainGroup doors;
+// doors.Add(activeDoor);
+// ...
+// // each frame:
+// auto result = doors.DrainBudget(1000, std::chrono::microseconds(500));
+//
+// Objects that are drained should not also be attached to a Scheduler.
+#pragma once
+
+#include "Scheduler.h"
+
+#include <chrono>
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+namespace LeanHsm
+{
+
+using DrainClock = std::chrono::steady_clock;
+
+struct DrainResult
+{
+	size_t handled;   // events dispatched by this call
+	size_t remaining; // events still queued when this call returned
+};
+
+// Dispatches queued events until the deadline passes, or maxEvents have been
+// dispatched, or no events remain.
+inline DrainResult DrainUntil(ActiveObject& object, DrainClock::time_point deadline,
+	size_t maxEvents = std::numeric_limits<size_t>::max())
+{
+	size_t handled = 0;
+	while (handled < maxEvents && object.HasPending() && DrainClock::now() < deadline)
+	{
+		object.Run(1);
+		++handled;
+	}
+	return DrainResult{ handled, object.PendingCount() };
+}
+
+// Dispatches up to maxEvents queued events, for up to maxTime.
+inline DrainResult DrainBudget(ActiveObject& object, size_t maxEvents, DrainClock::duration maxTime)
+{
+	return DrainUntil(object, DrainClock::now() + maxTime, maxEvents);
+}
+
+// DrainGroup drains many active objects fairly, in round-robin order
+class DrainGroup
+{
+public:
+	// Adds an object to the group. The object must outlive the group.
+	void Add(ActiveObject& object) { mObjects.push_back(&object); }
+
+	size_t Size() const { return mObjects.size(); }
+
+	// Dispatches events, one per object in turn, until the deadline passes,
+	// or maxEvents have been dispatched, or no events remain. The next call
+	// continues with the object after the last one that was served.
+	DrainResult DrainUntil(DrainClock::time_point deadline,
+		size_t maxEvents = std::numeric_limits<size_t>::max());
+
+	DrainResult DrainBudget(size_t maxEvents, DrainClock::duration maxTime)
+	{
+		return DrainUntil(DrainClock::now() + maxTime, maxEvents);
+	}
+
+	// Returns the number of events queued in all objects of the group.
+	size_t PendingCount() const
+	{
+		size_t count = 0;
+		for (auto object : mObjects)
+		{
+			count += object->PendingCount();
+		}
+		return count;
+	}
+
+private:
+	std::vector<ActiveObject*> mObjects;
+	size_t mNext{ 0 };
+};
+
+inline DrainResult DrainGroup::DrainUntil(DrainClock::time_point deadline, size_t maxEvents)
+{
+	size_t handled = 0;
+	size_t idleCount = 0; // objects found empty since the last event
+	while (handled < maxEvents && idleCount < mObjects.size() && DrainClock::now() < deadline)
+	{
+		auto object = mObjects[mNext];
+		mNext = (mNext + 1) % mObjects.size();
+		if (object->HasPending())
+		{
+			object->Run(1);
+			++handled;
+			idleCount = 0;
+		}
+		else
+		{
+			++idleCount;
+		}
+	}
+	return DrainResult{ handled, PendingCount() };
+}
+
+} // namespace LeanHsm
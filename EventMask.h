@@ -0,0 +1,83 @@
+// Copyright 2016, Jason Conaway
+// Per-event tables (pending flags, accept masks, etc.) require events that
+// convert to small, dense integers, like Door::Event. Such tables have room
+// for LEAN_HSM_MAX_EVENTS events, which may be overridden at build time.
+// Events with larger values are never found in these tables, and are never
+// members of event sets (see EventSet and When).
+//
+// Other event types (e.g. strings) only have exact transitions: they have no
+// table index, so they are never in a table, and can't be used in event sets.
+#pragma once
+
+#include <bitset>
+#include <cstddef>
+#include <initializer_list>
+#include <type_traits>
+
+#ifndef LEAN_HSM_MAX_EVENTS
+#define LEAN_HSM_MAX_EVENTS 64
+#endif
+
+namespace LeanHsm
+{
+
+const size_t MaxEvents = LEAN_HSM_MAX_EVENTS;
+
+// A set of events, indexed by EventIndex
+using EventMask = std::bitset<MaxEvents>;
+
+// True for event types that convert to table indices: enums and integers
+template<typename EventType>
+struct IsDenseEvent : std::integral_constant<bool,
+	std::is_enum<EventType>::value || std::is_integral<EventType>::value> {};
+
+template<typename EventType>
+size_t EventIndex(const EventType& e, std::true_type) { return static_cast<size_t>(e); }
+template<typename EventType>
+size_t EventIndex(const EventType&, std::false_type) { return MaxEvents; }
+
+// Returns the table index of an event, or MaxEvents (which is in no table)
+// for event types that aren't dense
+template<typename EventType>
+size_t EventIndex(const EventType& e) { return EventIndex(e, IsDenseEvent<EventType>()); }
+
+// Returns the event with a table index (the inverse of EventIndex)
+template<typename EventType>
+EventType EventFromIndex(size_t i)
+{
+	static_assert(IsDenseEvent<EventType>::value, "Only dense event types have table indices");
+	return static_cast<EventType>(i);
+}
+
+// Returns the set of the listed events, e.g. a category:
+//   const EventMask DamageEvents = EventSet({ Event::Fire, Event::Ice });
+template<typename EventType>
+EventMask EventSet(std::initializer_list<EventType> events)
+{
+	EventMask mask;
+	for (auto& e : events)
+	{
+		if (EventIndex(e) < MaxEvents)
+		{
+			mask.set(EventIndex(e));
+		}
+	}
+	return mask;
+}
+
+// Returns the set of events from 'first' to 'last', inclusive
+template<typename EventType>
+EventMask EventRange(const EventType& first, const EventType& last)
+{
+	EventMask mask;
+	for (auto i = EventIndex(first); i <= EventIndex(last) && i < MaxEvents; ++i)
+	{
+		mask.set(i);
+	}
+	return mask;
+}
+
+// Returns the set of every event that fits in the tables (a wildcard)
+inline EventMask AnyEvent() { return EventMask().set(); }
+
+} // namespace LeanHsm
@@ -0,0 +1,266 @@
+// Copyright 2016, Jason Conaway
+// EventQueue holds events for a state machine until they are dispatched.
+// Any thread may post events; one thread at a time dispatches them.
+// Events may carry a Payload, which moves through the queue without copying.
+//
+// The queue has a fixed capacity, and a policy, chosen at construction, for
+// bursts of events:
+// - Reject: When the queue is full, the new event is rejected.
+// - DropOldest: When the queue is full, the oldest event is dropped to make
+//   room for the new event.
+// - Coalesce: An event without a payload is merged into an identical event
+//   at the tail of its lane (i.e. the newest event, if it is not yet popped),
+//   so bursts of the same event are handled once, and never ahead of events
+//   that were posted before them. Otherwise, it is like Reject. Posters of
+//   a coalescing queue take a lock per lane, to post and check the tail as
+//   one step.
+// The outcome of each post is counted.
+//
+// PostAccepted filters events at ingress: events that are not in an accept
+// mask (e.g. the events the machine's current state handles) are discarded
+// before they take up room in the queue.
+//
+// Each priority has its own lane, with the full capacity of the queue, and
+// lanes are popped in priority order. So a critical event (e.g. shutdown)
+// is dispatched before any normal or background events that are pending.
+// Policies apply within a lane; e.g. DropOldest drops the oldest event of
+// the same priority.
+#pragma once
+
+#include "BoundedQueue.h"
+#include "EventMask.h"
+#include "Payload.h"
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+namespace LeanHsm
+{
+
+template<typename EventType>
+struct Message
+{
+	EventType event;
+	Payload payload;
+};
+
+enum class QueuePolicy { Reject, DropOldest, Coalesce };
+
+enum class Priority { Critical, Normal, Background };
+const size_t PriorityCount = 3;
+
+enum class PostResult
+{
+	Accepted,      // the event was queued
+	Rejected,      // the queue was full; the event was not queued
+	DroppedOldest, // the event was queued after dropping the oldest event
+	Coalesced,     // the event was merged into the identical event at the tail
+	Filtered       // the event was not in the accept mask; it was not queued
+};
+
+// Counts of the outcomes of posting to a queue
+struct QueueStats
+{
+	size_t accepted;
+	size_t rejected;
+	size_t droppedOldest;
+	size_t coalesced;
+	size_t filtered;
+};
+
+template<typename EventType>
+class EventQueue
+{
+public:
+	explicit EventQueue(size_t capacity, QueuePolicy policy = QueuePolicy::Reject)
+		: mPolicy(policy)
+	{
+		for (auto& lane : mLanes)
+		{
+			lane.reset(new BoundedQueue<Message<EventType>>(capacity));
+		}
+		if (policy == QueuePolicy::Coalesce)
+		{
+			mTails.reset(new Tail[PriorityCount]);
+		}
+	}
+
+	EventQueue(const EventQueue&) = delete;
+	EventQueue& operator=(const EventQueue&) = delete;
+
+	// Appends an event to the lane of its priority, according to the queue's
+	// policy. If the event is not queued, then its payload is released.
+	PostResult Post(const EventType& e, Priority priority, Payload payload = Payload());
+	PostResult Post(const EventType& e, Payload payload = Payload())
+	{
+		return Post(e, Priority::Normal, std::move(payload));
+	}
+
+	// Same as Post, but discards the event (releasing its payload) if it is
+	// not in the accept mask. Events that have no index in a mask (see
+	// EventMask.h) are never filtered.
+	PostResult PostAccepted(const EventType& e, const EventMask& accepted, Priority priority, Payload payload = Payload())
+	{
+		auto i = EventIndex(e);
+		if (i < MaxEvents && !accepted.test(i))
+		{
+			return Count(PostResult::Filtered);
+		}
+		return Post(e, priority, std::move(payload));
+	}
+
+	// Removes the oldest message of the highest priority.
+	// Returns false if the queue is empty.
+	bool Pop(Message<EventType>& message);
+
+	size_t SizeHint() const
+	{
+		size_t size = 0;
+		for (auto& lane : mLanes)
+		{
+			size += lane->SizeHint();
+		}
+		return size;
+	}
+	bool Empty() const { return SizeHint() == 0; }
+	QueuePolicy Policy() const { return mPolicy; }
+
+	QueueStats Stats() const
+	{
+		return QueueStats{
+			mAccepted.load(std::memory_order_relaxed),
+			mRejected.load(std::memory_order_relaxed),
+			mDroppedOldest.load(std::memory_order_relaxed),
+			mCoalesced.load(std::memory_order_relaxed),
+			mFiltered.load(std::memory_order_relaxed) };
+	}
+
+private:
+	// The newest event of a lane, for Coalesce. It is still pending while
+	// fewer messages have been popped from the lane than pushed.
+	struct Tail
+	{
+		std::mutex mutex; // held by posters
+		EventType event{};
+		bool coalescable{ false };
+		size_t pushed{ 0 };
+		std::atomic<size_t> popped{ 0 };
+	};
+
+	PostResult PostCoalescing(size_t lane, const EventType& e, Payload payload);
+	bool PopLane(size_t lane, Message<EventType>& message);
+
+	PostResult Count(PostResult result)
+	{
+		switch (result)
+		{
+		case PostResult::Accepted: mAccepted.fetch_add(1, std::memory_order_relaxed); break;
+		case PostResult::Rejected: mRejected.fetch_add(1, std::memory_order_relaxed); break;
+		case PostResult::DroppedOldest: mDroppedOldest.fetch_add(1, std::memory_order_relaxed); break;
+		case PostResult::Coalesced: mCoalesced.fetch_add(1, std::memory_order_relaxed); break;
+		case PostResult::Filtered: mFiltered.fetch_add(1, std::memory_order_relaxed); break;
+		}
+		return result;
+	}
+
+	std::unique_ptr<BoundedQueue<Message<EventType>>> mLanes[PriorityCount];
+	QueuePolicy mPolicy;
+	std::unique_ptr<Tail[]> mTails; // per lane, for Coalesce
+	std::atomic<size_t> mAccepted{ 0 };
+	std::atomic<size_t> mRejected{ 0 };
+	std::atomic<size_t> mDroppedOldest{ 0 };
+	std::atomic<size_t> mCoalesced{ 0 };
+	std::atomic<size_t> mFiltered{ 0 };
+};
+
+///////////////////////////////////////////////////////////////////////////
+// EventQueue implementation
+
+template<typename EventType>
+PostResult EventQueue<EventType>::Post(const EventType& e, Priority priority, Payload payload)
+{
+	auto lane = size_t(priority);
+	if (mTails)
+	{
+		return PostCoalescing(lane, e, std::move(payload));
+	}
+
+	Message<EventType> message{ e, std::move(payload) };
+	if (mLanes[lane]->TryPush(std::move(message)))
+	{
+		return Count(PostResult::Accepted);
+	}
+
+	if (mPolicy == QueuePolicy::DropOldest)
+	{
+		// make room; another thread may take the room first, so keep trying
+		Message<EventType> oldest{ e, Payload() };
+		do
+		{
+			if (PopLane(lane, oldest))
+			{
+				oldest.payload.Reset();
+			}
+		} while (!mLanes[lane]->TryPush(std::move(message)));
+		return Count(PostResult::DroppedOldest);
+	}
+	return Count(PostResult::Rejected);
+}
+
+template<typename EventType>
+PostResult EventQueue<EventType>::PostCoalescing(size_t lane, const EventType& e, Payload payload)
+{
+	// other posters wait, so the tail can't change between checking and pushing;
+	// a concurrent pop may take the tail, but only after this post is merged
+	auto& tail = mTails[lane];
+	std::lock_guard<std::mutex> lock(tail.mutex);
+	bool coalescable = !payload;
+	if (coalescable && tail.coalescable && tail.event == e &&
+		tail.popped.load(std::memory_order_acquire) < tail.pushed)
+	{
+		return Count(PostResult::Coalesced);
+	}
+
+	Message<EventType> message{ e, std::move(payload) };
+	if (!mLanes[lane]->TryPush(std::move(message)))
+	{
+		return Count(PostResult::Rejected);
+	}
+	tail.event = e;
+	tail.coalescable = coalescable;
+	++tail.pushed;
+	return Count(PostResult::Accepted);
+}
+
+template<typename EventType>
+bool EventQueue<EventType>::Pop(Message<EventType>& message)
+{
+	for (size_t lane = 0; lane < PriorityCount; ++lane)
+	{
+		if (PopLane(lane, message))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+template<typename EventType>
+bool EventQueue<EventType>::PopLane(size_t lane, Message<EventType>& message)
+{
+	if (!mLanes[lane]->TryPop(message))
+	{
+		return false;
+	}
+
+	if (mTails)
+	{
+		mTails[lane].popped.fetch_add(1, std::memory_order_acq_rel);
+	}
+	return true;
+}
+
+} // namespace LeanHsm
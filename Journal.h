@@ -0,0 +1,547 @@
+// Copyright 2016, Jason Conaway
+// TransitionJournal is a write-ahead log of committed transitions, so that
+// the states of many machines survive a crash. Records are appended from any
+// thread, and a committer thread writes and syncs them to disk in groups, so
+// one fsync covers many transitions (group commit). A caller that must not
+// acknowledge a request until its transition is durable waits for it with
+// WaitDurable.
+//
+// Recovery reads the latest snapshot (see WriteSnapshot) and applies the
+// journal records that follow it, to find the state of each instance.
+//
+// Records and snapshots hold state indices, which don't say where a state
+// of a submachine is placed, so populations whose graph has submachines
+// (see StateGraph::HasSubmachines) are neither journaled nor restored.
+//
+// USAGE:
+// LeanHsm::TransitionJournal journal;
+// journal.Open("doors.journal", 256, std::chrono::milliseconds(2));
+// LeanHsm::JournalTransitions(journal, doors);   // doors is a Population
+// ...
+// door.HandleEvent(Door::Event::Lock);
+// journal.WaitDurable(journal.AppendedSequence()); // then acknowledge
+//
+// // after a restart:
+// LeanHsm::RecoveredStates recovered;
+// LeanHsm::Recover("doors.snapshot", "doors.journal", graph.Fingerprint(), recovered);
+// LeanHsm::RestoreStates(doors, recovered);
+#pragma once
+
+#include "EventMask.h"
+#include "Population.h"
+#include "StateGraph.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <io.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace LeanHsm
+{
+
+// A journal record, as stored on disk
+struct JournalRecord
+{
+	uint64_t sequence;
+	uint32_t instance;
+	uint32_t from;  // state index
+	uint32_t event; // event index
+	uint32_t to;    // state index
+	uint32_t checksum;
+	uint32_t reserved;
+};
+
+// The instance states that were recovered from a snapshot and journal.
+// Instances without a recovered state have StateGraph's InvalidIndex.
+struct RecoveredStates
+{
+	uint64_t sequence; // the last sequence that was applied
+	std::vector<uint32_t> states;
+};
+
+class TransitionJournal
+{
+public:
+	TransitionJournal() = default;
+	~TransitionJournal()
+	{
+		for (auto& detach : mDetachers)
+		{
+			detach();
+		}
+		Close();
+	}
+
+	TransitionJournal(const TransitionJournal&) = delete;
+	TransitionJournal& operator=(const TransitionJournal&) = delete;
+
+	// Opens the journal for appending, and starts the committer thread. It
+	// commits when groupSize records are waiting, or maxDelay after the first
+	// one arrives, whichever is sooner. A torn or corrupt tail is truncated.
+	// Returns false if the file can't be opened.
+	bool Open(const std::string& path, size_t groupSize, std::chrono::milliseconds maxDelay);
+
+	// Commits the remaining records, and stops the committer thread.
+	void Close();
+
+	// Appends a record, and returns its sequence number. May be called from any thread.
+	uint64_t Append(uint32_t instance, uint32_t from, uint32_t event, uint32_t to);
+
+	// Returns the sequence number of the last appended record.
+	uint64_t AppendedSequence() const;
+
+	// Returns the sequence number of the last record that is on disk.
+	uint64_t DurableSequence() const;
+
+	// Blocks until the record with this sequence number is on disk.
+	// Returns false if the journal failed or was closed first.
+	bool WaitDurable(uint64_t sequence);
+
+	// Adds a function that the destructor calls, before closing, to remove a
+	// hook that appends to the journal (see JournalTransitions).
+	void AddDetacher(const std::function<void()>& detach) { mDetachers.push_back(detach); }
+
+	// Returns true if a commit failed. A failed journal stops committing, since
+	// later records can't be durable without the earlier ones; later records are
+	// discarded, and waits for them fail. Reopen the journal to recover.
+	bool Failed() const;
+
+	// Flushes a file, and syncs it to disk. Returns false on failure.
+	static bool Sync(std::FILE* file);
+
+	// Atomically replaces the file at path with the file at replacement, and
+	// syncs the directory, so the replacement survives a crash.
+	// Returns false on failure.
+	static bool Replace(const std::string& replacement, const std::string& path);
+
+	// Detects torn or corrupt records
+	static uint32_t Checksum(const JournalRecord& r)
+	{
+		uint64_t h = 14695981039346656037ull;
+		for (uint64_t v : { r.sequence, uint64_t(r.instance), uint64_t(r.from), uint64_t(r.event), uint64_t(r.to) })
+		{
+			h = (h ^ v) * 1099511628211ull;
+		}
+		return uint32_t(h ^ (h >> 32));
+	}
+
+private:
+	void CommitLoop();
+
+	std::FILE* mFile{ nullptr };
+	size_t mGroupSize{ 1 };
+	std::chrono::milliseconds mMaxDelay{ 0 };
+	std::vector<JournalRecord> mPending; // guarded by mMutex
+	uint64_t mAppended{ 0 };             // guarded by mMutex
+	uint64_t mDurable{ 0 };              // guarded by mMutex
+	bool mFailed{ false };               // guarded by mMutex
+	bool mStopping{ false };             // guarded by mMutex
+	bool mRunning{ false };              // guarded by mMutex
+	mutable std::mutex mMutex;
+	std::condition_variable mCommitWake;
+	std::condition_variable mDurableWake;
+	std::thread mCommitter;
+	std::vector<std::function<void()>> mDetachers;
+};
+
+// Journals the committed transitions of every instance of the population,
+// including internal transitions, but not initial transitions, restores, or
+// replayed transitions, until the journal is destroyed. Returns false, without
+// journaling, if the graph has submachines.
+template<typename EventType>
+bool JournalTransitions(TransitionJournal& journal, Population<EventType>& population)
+{
+	using Hsm = StateMachine<EventType>;
+	auto& graph = population.GetGraph();
+	if (graph.HasSubmachines())
+	{
+		return false;
+	}
+	for (uint32_t id = 0; id < population.Size(); ++id)
+	{
+		auto& sm = population.Instance(id);
+		auto hook = sm.AddCommitHook([&journal, &graph, id](Hsm& sm, const typename Hsm::Commit& c) {
+			if (c.event && !sm.IsReplaying())
+			{
+				journal.Append(id, graph.IndexOf(*c.from), uint32_t(EventIndex(*c.event)), graph.IndexOf(*c.to));
+			}
+		});
+		journal.AddDetacher([&sm, hook] { sm.RemoveCommitHook(hook); });
+	}
+	return true;
+}
+
+// Writes the state of every instance, and the journal's durable sequence. Take
+// snapshots while no events are being dispatched; records between the durable
+// and appended sequences are applied again on recovery, which is harmless.
+// Returns false on failure, or if the graph has submachines.
+template<typename EventType>
+bool WriteSnapshot(const std::string& path, const Population<EventType>& population, const TransitionJournal& journal);
+
+// Reads a snapshot. A missing snapshot is empty, with sequence 0.
+// Returns false if the snapshot belongs to a different graph, or can't be read.
+bool ReadSnapshot(const std::string& path, uint64_t graphFingerprint, RecoveredStates& recovered);
+
+// Invokes visitor(const JournalRecord&) for each valid record after the sequence.
+template<typename Visitor>
+void ReadJournal(const std::string& path, uint64_t afterSequence, Visitor&& visitor);
+
+// Reads the snapshot (if it exists) and then the journal records that follow it.
+// Returns false if the snapshot belongs to a different graph, or can't be read.
+bool Recover(const std::string& snapshotPath, const std::string& journalPath,
+	uint64_t graphFingerprint, RecoveredStates& recovered);
+
+// Restores the recovered states into the population's machines (see
+// StateMachine::Restore). Returns false, without restoring, if the graph has
+// submachines.
+template<typename EventType>
+bool RestoreStates(Population<EventType>& population, const RecoveredStates& recovered)
+{
+	auto& graph = population.GetGraph();
+	if (graph.HasSubmachines())
+	{
+		return false;
+	}
+	for (uint32_t id = 0; id < population.Size() && id < recovered.states.size(); ++id)
+	{
+		auto stateIndex = recovered.states[id];
+		if (stateIndex < graph.StateCount())
+		{
+			population.Instance(id).Restore(graph.StateAt(stateIndex));
+		}
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Snapshot format
+
+struct SnapshotHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t fingerprint;
+	uint64_t sequence;
+	uint32_t instanceCount;
+	uint32_t reserved;
+
+	enum : uint32_t { Magic = 0x4C48534Eu }; // "LHSN"
+	enum : uint32_t { Version = 1 };
+};
+
+///////////////////////////////////////////////////////////////////////////
+// TransitionJournal implementation
+
+inline bool TransitionJournal::Open(const std::string& path, size_t groupSize, std::chrono::milliseconds maxDelay)
+{
+	Close();
+
+	// find the end of the valid records, so that new records continue the
+	// sequence and overwrite any torn tail
+	uint64_t lastSequence = 0;
+	long validEnd = 0;
+	mFile = std::fopen(path.c_str(), "r+b");
+	if (mFile)
+	{
+		JournalRecord record;
+		while (std::fread(&record, sizeof(record), 1, mFile) == 1 &&
+			record.checksum == Checksum(record) && record.sequence > lastSequence)
+		{
+			lastSequence = record.sequence;
+			validEnd += long(sizeof(record));
+		}
+
+		// drop the tail, so that stale records after it are never recovered,
+		// even if new records are shorter than the tail
+		bool truncated = std::fflush(mFile) == 0;
+#ifdef _WIN32
+		truncated = truncated && _chsize(_fileno(mFile), validEnd) == 0;
+#else
+		truncated = truncated && ftruncate(fileno(mFile), off_t(validEnd)) == 0;
+#endif
+		if (!truncated || !Sync(mFile))
+		{
+			Close();
+			return false;
+		}
+	}
+	else
+	{
+		mFile = std::fopen(path.c_str(), "w+b");
+	}
+	if (!mFile || std::fseek(mFile, validEnd, SEEK_SET) != 0)
+	{
+		Close();
+		return false;
+	}
+
+	mGroupSize = std::max<size_t>(groupSize, 1);
+	mMaxDelay = maxDelay;
+	mPending.reserve(mGroupSize);
+	mAppended = lastSequence;
+	mDurable = lastSequence;
+	mStopping = false;
+	mFailed = false;
+	mRunning = true;
+	mCommitter = std::thread(&TransitionJournal::CommitLoop, this);
+	return true;
+}
+
+inline void TransitionJournal::Close()
+{
+	if (mCommitter.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mStopping = true;
+		}
+		mCommitWake.notify_one();
+		mCommitter.join();
+	}
+	if (mFile)
+	{
+		std::fclose(mFile);
+		mFile = nullptr;
+	}
+}
+
+inline uint64_t TransitionJournal::Append(uint32_t instance, uint32_t from, uint32_t event, uint32_t to)
+{
+	bool wake;
+	uint64_t sequence;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		sequence = ++mAppended;
+		if (mFailed)
+		{
+			return sequence; // never durable
+		}
+		JournalRecord record{ sequence, instance, from, event, to, 0, 0 };
+		record.checksum = Checksum(record);
+		mPending.push_back(record);
+		wake = mPending.size() == 1 || mPending.size() >= mGroupSize;
+	}
+	if (wake)
+	{
+		mCommitWake.notify_one();
+	}
+	return sequence;
+}
+
+inline uint64_t TransitionJournal::AppendedSequence() const
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mAppended;
+}
+
+inline uint64_t TransitionJournal::DurableSequence() const
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mDurable;
+}
+
+inline bool TransitionJournal::WaitDurable(uint64_t sequence)
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	if (sequence > mAppended)
+	{
+		return false;
+	}
+	mDurableWake.wait(lock, [&] { return mDurable >= sequence || mFailed || !mRunning; });
+	return mDurable >= sequence;
+}
+
+inline bool TransitionJournal::Failed() const
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mFailed;
+}
+
+inline void TransitionJournal::CommitLoop()
+{
+	std::vector<JournalRecord> group;
+	group.reserve(mGroupSize);
+	std::unique_lock<std::mutex> lock(mMutex);
+	for (;;)
+	{
+		mCommitWake.wait(lock, [this] { return mStopping || !mPending.empty(); });
+		if (mPending.empty())
+		{
+			break; // stopping, and nothing left to commit
+		}
+
+		// give other threads until the deadline to fill the group
+		auto deadline = std::chrono::steady_clock::now() + mMaxDelay;
+		mCommitWake.wait_until(lock, deadline, [this] { return mStopping || mPending.size() >= mGroupSize; });
+
+		group.swap(mPending);
+		auto last = group.back().sequence;
+		lock.unlock();
+		bool written = std::fwrite(group.data(), sizeof(JournalRecord), group.size(), mFile) == group.size();
+		bool synced = written && Sync(mFile);
+		group.clear();
+		lock.lock();
+
+		if (!synced)
+		{
+			// the group may be partly on disk, so nothing after it can be durable
+			mFailed = true;
+			mPending.clear();
+			break;
+		}
+		mDurable = last;
+		mDurableWake.notify_all();
+	}
+	mRunning = false;
+	mDurableWake.notify_all();
+}
+
+inline bool TransitionJournal::Sync(std::FILE* file)
+{
+	if (std::fflush(file) != 0)
+	{
+		return false;
+	}
+#ifdef _WIN32
+	return _commit(_fileno(file)) == 0;
+#else
+	return fsync(fileno(file)) == 0;
+#endif
+}
+
+inline bool TransitionJournal::Replace(const std::string& replacement, const std::string& path)
+{
+#ifdef _WIN32
+	return MoveFileExA(replacement.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+	if (std::rename(replacement.c_str(), path.c_str()) != 0)
+	{
+		return false;
+	}
+	auto slash = path.find_last_of('/');
+	auto directory = slash == std::string::npos ? std::string(".") : path.substr(0, slash + 1);
+	int fd = open(directory.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		return false;
+	}
+	bool synced = fsync(fd) == 0;
+	return close(fd) == 0 && synced;
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Snapshot and recovery implementation
+
+template<typename EventType>
+bool WriteSnapshot(const std::string& path, const Population<EventType>& population, const TransitionJournal& journal)
+{
+	if (population.GetGraph().HasSubmachines())
+	{
+		return false;
+	}
+
+	// write to a temporary file, then replace the old snapshot
+	auto temporaryPath = path + ".tmp";
+	auto file = std::fopen(temporaryPath.c_str(), "wb");
+	if (!file)
+	{
+		return false;
+	}
+	SnapshotHeader header{ SnapshotHeader::Magic, SnapshotHeader::Version,
+		population.GetGraph().Fingerprint(), journal.DurableSequence(), uint32_t(population.Size()), 0 };
+	bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+	for (uint32_t id = 0; ok && id < population.Size(); ++id)
+	{
+		auto stateIndex = population.StateIndexOf(id);
+		ok = std::fwrite(&stateIndex, sizeof(stateIndex), 1, file) == 1;
+	}
+	ok = ok && TransitionJournal::Sync(file);
+	ok = std::fclose(file) == 0 && ok;
+	return ok && TransitionJournal::Replace(temporaryPath, path);
+}
+
+inline bool ReadSnapshot(const std::string& path, uint64_t graphFingerprint, RecoveredStates& recovered)
+{
+	recovered.sequence = 0;
+	recovered.states.clear();
+
+	auto file = std::fopen(path.c_str(), "rb");
+	if (!file)
+	{
+		return true; // no snapshot yet
+	}
+	SnapshotHeader header;
+	bool ok = std::fread(&header, sizeof(header), 1, file) == 1 &&
+		header.magic == SnapshotHeader::Magic && header.version == SnapshotHeader::Version &&
+		header.fingerprint == graphFingerprint;
+	if (ok)
+	{
+		recovered.sequence = header.sequence;
+		recovered.states.resize(header.instanceCount);
+		ok = header.instanceCount == 0 ||
+			std::fread(recovered.states.data(), sizeof(uint32_t), header.instanceCount, file) == header.instanceCount;
+	}
+	std::fclose(file);
+	return ok;
+}
+
+template<typename Visitor>
+void ReadJournal(const std::string& path, uint64_t afterSequence, Visitor&& visitor)
+{
+	auto file = std::fopen(path.c_str(), "rb");
+	if (!file)
+	{
+		return;
+	}
+	// stop at the first torn or corrupt record; nothing after it was acknowledged
+	JournalRecord record;
+	uint64_t lastSequence = 0;
+	while (std::fread(&record, sizeof(record), 1, file) == 1 &&
+		record.checksum == TransitionJournal::Checksum(record) && record.sequence > lastSequence)
+	{
+		lastSequence = record.sequence;
+		if (record.sequence > afterSequence)
+		{
+			visitor(record);
+		}
+	}
+	std::fclose(file);
+}
+
+inline bool Recover(const std::string& snapshotPath, const std::string& journalPath,
+	uint64_t graphFingerprint, RecoveredStates& recovered)
+{
+	if (!ReadSnapshot(snapshotPath, graphFingerprint, recovered))
+	{
+		return false;
+	}
+	ReadJournal(journalPath, recovered.sequence, [&recovered](const JournalRecord& record) {
+		if (record.instance >= recovered.states.size())
+		{
+			recovered.states.resize(record.instance + 1, ~0u);
+		}
+		recovered.states[record.instance] = record.to;
+		recovered.sequence = record.sequence;
+	});
+	return true;
+}
+
+} // namespace LeanHsm
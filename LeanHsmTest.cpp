@@ -4,22 +4,94 @@
 // a flexible and efficient hierarchical finite state machine class.
 //
 
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
 #include <iostream>
 #include <limits>
+#include <memory>
 #include <string>
+#include <thread>
+#include <vector>
 
+#include "ActiveMachine.h"
+#include "ChangeLog.h"
+#include "Drain.h"
 #include "Door.h"
+#include "Journal.h"
+#include "Population.h"
+#include "Replay.h"
+#include "SharedEventRing.h"
+#include "SharedStatePool.h"
 
 ///////////////////////////////////////////////////////////////////////////////
 
 bool Test_Door();
+bool Test_Snapshot();
+bool Test_ChangeLog();
+bool Test_Population();
+bool Test_BulkDispatch();
+bool Test_ParallelDispatch();
+bool Test_Scheduler();
+bool Test_Messaging();
+bool Test_QueuePolicies();
+bool Test_PriorityLanes();
+bool Test_Drain();
+bool Test_SignalPosting();
+bool Test_SharedStatePool();
+bool Test_SharedEventRing();
+bool Test_Journal();
+bool Test_Replay();
+bool Test_Fork();
+bool Test_ConfigurationHash();
+bool Test_Reachability();
+bool Test_EnabledEvents();
+bool Test_IngressFilter();
+bool Test_Deferral();
+bool Test_Completion();
+bool Test_Pseudostates();
+bool Test_EventSets();
+bool Test_Submachines();
+bool Test_StringEvents();
 
-int main()
+void ReportResult(const char* testName, bool passed)
 {
 	std::cout
-		<< "Door| Test result: "
-		<< (Test_Door() ? "SUCCESS" : "FAILURE")
+		<< testName << "| Test result: "
+		<< (passed ? "SUCCESS" : "FAILURE")
 		<< std::endl << std::endl;
+}
+
+int main()
+{
+	ReportResult("Door", Test_Door());
+	ReportResult("Snapshot", Test_Snapshot());
+	ReportResult("ChangeLog", Test_ChangeLog());
+	ReportResult("Population", Test_Population());
+	ReportResult("BulkDispatch", Test_BulkDispatch());
+	ReportResult("ParallelDispatch", Test_ParallelDispatch());
+	ReportResult("Scheduler", Test_Scheduler());
+	ReportResult("Messaging", Test_Messaging());
+	ReportResult("QueuePolicies", Test_QueuePolicies());
+	ReportResult("PriorityLanes", Test_PriorityLanes());
+	ReportResult("Drain", Test_Drain());
+	ReportResult("SignalPosting", Test_SignalPosting());
+	ReportResult("SharedStatePool", Test_SharedStatePool());
+	ReportResult("SharedEventRing", Test_SharedEventRing());
+	ReportResult("Journal", Test_Journal());
+	ReportResult("Replay", Test_Replay());
+	ReportResult("Fork", Test_Fork());
+	ReportResult("ConfigurationHash", Test_ConfigurationHash());
+	ReportResult("Reachability", Test_Reachability());
+	ReportResult("EnabledEvents", Test_EnabledEvents());
+	ReportResult("IngressFilter", Test_IngressFilter());
+	ReportResult("Deferral", Test_Deferral());
+	ReportResult("Completion", Test_Completion());
+	ReportResult("Pseudostates", Test_Pseudostates());
+	ReportResult("EventSets", Test_EventSets());
+	ReportResult("Submachines", Test_Submachines());
+	ReportResult("StringEvents", Test_StringEvents());
 
 	std::cout << "Press ENTER to continue... " << std::flush;
 	std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
@@ -32,6 +104,28 @@ int main()
 #define REQUIRE_TRUE(x) { if (!(x)) return false; }
 #define REQUIRE_FALSE(x) { if (x) return false; }
 
+void QuietLog(const char*, va_list) {}
+
+template<typename EventType>
+std::string EventName(EventType e) { return std::to_string(int(e)); }
+std::string EventName(const std::string& e) { return e; }
+
+// A machine for the tests' state definitions, initialized where it's
+// constructed. It logs nowhere unless given a log.
+template<typename EventType>
+class TestMachine : public LeanHsm::StateMachine<EventType>
+{
+public:
+	using Hsm = LeanHsm::StateMachine<EventType>;
+
+	explicit TestMachine(const typename Hsm::State& topState,
+		const typename Hsm::Log& log = QuietLog)
+		: Hsm(topState, log, [](const EventType& e) { return EventName(e); })
+	{
+		this->Initialize();
+	}
+};
+
 bool Test_Door()
 {
 	using Event = Door::Event;
@@ -75,3 +169,1799 @@ bool Test_Door()
 
 	return true; // passed all requirements
 }
+
+bool Test_Snapshot()
+{
+	using Event = Door::Event;
+
+	Door door;
+	REQUIRE_TRUE(&door.GetStateSnapshot() == &door.GetState());
+	REQUIRE_TRUE(door.IsInStateSnapshot(door.Unlocked));
+
+	// A reader on another thread must only ever observe committed states,
+	// never the intermediate Closed state visited between Locked and Unlocked.
+	std::atomic<bool> done{ false };
+	std::atomic<bool> sawIntermediate{ false };
+	std::thread reader([&] {
+		while (!done)
+		{
+			const Door::State& s = door.GetStateSnapshot();
+			if (&s != &door.Locked && &s != &door.Unlocked)
+			{
+				sawIntermediate = true;
+			}
+		}
+	});
+	for (int i = 0; i < 50; ++i)
+	{
+		door.HandleEvent(Event::Lock);
+		door.HandleEvent(Event::Unlock);
+	}
+	done = true;
+	reader.join();
+	REQUIRE_FALSE(sawIntermediate);
+
+	REQUIRE_TRUE(door.HandleEvent(Event::Lock));
+	REQUIRE_TRUE(&door.GetStateSnapshot() == &door.Locked);
+	REQUIRE_TRUE(door.IsInStateSnapshot(door.Closed));
+
+	return true; // passed all requirements
+}
+
+bool Test_ChangeLog()
+{
+	using Event = Door::Event;
+
+	Door frontDoor;
+	Door backDoor;
+	LeanHsm::ChangeLog<Event> changes(16);
+	changes.Subscribe(frontDoor.GetStateMachine());
+	changes.Subscribe(backDoor.GetStateMachine());
+
+	REQUIRE_TRUE(frontDoor.HandleEvent(Event::Lock));
+	REQUIRE_TRUE(frontDoor.HandleEvent(Event::Open)); // internal; not a change
+	REQUIRE_TRUE(backDoor.HandleEvent(Event::Open));
+
+	size_t count = 0;
+	bool inOrder = true;
+	changes.Drain([&](const LeanHsm::ChangeLog<Event>::Change& change) {
+		if (count == 0)
+		{
+			inOrder &= change.machine == &frontDoor.GetStateMachine();
+			inOrder &= change.from == &Door::Unlocked && change.to == &Door::Locked;
+		}
+		else
+		{
+			inOrder &= change.machine == &backDoor.GetStateMachine();
+			inOrder &= change.from == &Door::Unlocked && change.to == &Door::Opened;
+		}
+		++count;
+	});
+	REQUIRE_TRUE(count == 2);
+	REQUIRE_TRUE(inOrder);
+	REQUIRE_TRUE(changes.TakeOverflowCount() == 0);
+
+	// Changes beyond the capacity are counted rather than recorded
+	for (int i = 0; i < 10; ++i)
+	{
+		frontDoor.HandleEvent(Event::Unlock);
+		frontDoor.HandleEvent(Event::Lock);
+	}
+	REQUIRE_TRUE(changes.Drain([](const LeanHsm::ChangeLog<Event>::Change&) {}) == 16);
+	REQUIRE_TRUE(changes.TakeOverflowCount() == 4);
+
+	// Unsubscribed machines, and machines of destroyed logs, record nothing
+	changes.Unsubscribe(frontDoor.GetStateMachine());
+	REQUIRE_TRUE(frontDoor.HandleEvent(Event::Unlock));
+	REQUIRE_TRUE(changes.Drain([](const LeanHsm::ChangeLog<Event>::Change&) {}) == 0);
+	{
+		LeanHsm::ChangeLog<Event> shortLived(4);
+		shortLived.Subscribe(frontDoor.GetStateMachine());
+	}
+	REQUIRE_TRUE(frontDoor.HandleEvent(Event::Lock));
+
+	return true; // passed all requirements
+}
+
+bool Test_Population()
+{
+	using Event = Door::Event;
+	using Doors = LeanHsm::Population<Event>;
+
+	LeanHsm::StateGraph<Event> graph(Door::Exists);
+	REQUIRE_TRUE(graph.StateCount() == 5);
+	REQUIRE_TRUE(graph.IsInState(graph.IndexOf(Door::Locked), graph.IndexOf(Door::Closed)));
+	REQUIRE_FALSE(graph.IsInState(graph.IndexOf(Door::Opened), graph.IndexOf(Door::Closed)));
+
+	Door doors[5];
+	Doors population(graph);
+	for (auto& door : doors)
+	{
+		REQUIRE_TRUE(population.Add(door.GetStateMachine()) != Doors::InvalidInstance);
+	}
+	REQUIRE_TRUE(population.CountIn(Door::Unlocked) == 5);
+
+	REQUIRE_TRUE(doors[1].HandleEvent(Event::Lock));
+	REQUIRE_TRUE(doors[3].HandleEvent(Event::Lock));
+	REQUIRE_TRUE(doors[4].HandleEvent(Event::Open));
+	REQUIRE_TRUE(population.CountIn(Door::Locked) == 2);
+	REQUIRE_TRUE(population.CountIn(Door::Unlocked) == 2);
+	REQUIRE_TRUE(population.CountIn(Door::Closed) == 4);
+	REQUIRE_TRUE(population.CountIn(Door::Opened) == 1);
+	REQUIRE_TRUE(population.CountIn(Door::Exists) == 5);
+
+	Doors::InstanceId lockedIds = 0;
+	size_t lockedCount = 0;
+	population.ForEachIn(Door::Locked, [&](Doors::InstanceId id) { lockedIds += id; ++lockedCount; });
+	REQUIRE_TRUE(lockedCount == 2 && lockedIds == 1 + 3);
+
+	size_t closedCount = 0;
+	population.ForEachIn(Door::Closed, [&](Doors::InstanceId id) {
+		closedCount += population.Instance(id).IsInState(Door::Closed) ? 1 : 0;
+	});
+	REQUIRE_TRUE(closedCount == 4);
+
+	REQUIRE_TRUE(doors[4].HandleEvent(Event::Close));
+	REQUIRE_TRUE(population.CountIn(Door::Opened) == 0);
+	REQUIRE_TRUE(population.CountIn(Door::Unlocked) == 3);
+
+	return true; // passed all requirements
+}
+
+bool Test_BulkDispatch()
+{
+	using Event = Door::Event;
+	using Doors = LeanHsm::Population<Event>;
+
+	LeanHsm::StateGraph<Event> graph(Door::Exists);
+	Door doors[6];
+	Doors population(graph);
+	for (auto& door : doors)
+	{
+		population.Add(door.GetStateMachine());
+	}
+	REQUIRE_TRUE(doors[0].HandleEvent(Event::Lock));
+	REQUIRE_TRUE(doors[2].HandleEvent(Event::Open));
+	REQUIRE_TRUE(doors[4].HandleEvent(Event::Lock));
+
+	// Unlocked doors open, locked doors rattle, and the opened door ignores it
+	REQUIRE_TRUE(population.DispatchAll(Event::Open) == 5);
+	REQUIRE_TRUE(doors[0].IsInState(Door::Locked));
+	REQUIRE_TRUE(doors[0].GetCurrentEffect() == "RattleLockedDoor");
+	REQUIRE_TRUE(doors[1].GetCurrentEffect() == "OpeningDoor");
+	REQUIRE_TRUE(doors[2].GetCurrentEffect() == "OpeningDoor");
+	REQUIRE_TRUE(population.CountIn(Door::Opened) == 4);
+	REQUIRE_TRUE(population.CountIn(Door::Locked) == 2);
+
+	REQUIRE_TRUE(population.Dispatch(Event::Close, { 5, 1, 0 }) == 2);
+	REQUIRE_TRUE(doors[1].IsInState(Door::Unlocked));
+	REQUIRE_TRUE(doors[5].IsInState(Door::Unlocked));
+	REQUIRE_TRUE(population.CountIn(Door::Opened) == 2);
+
+	return true; // passed all requirements
+}
+
+namespace LampTest
+{
+	// Lamps that log what they do, to a log that isn't thread-safe
+	enum class Event { Toggle };
+	using Hsm = LeanHsm::StateMachine<Event>;
+	using Name = Hsm::Name;
+	using StartIn = Hsm::StartIn;
+	using When = Hsm::When;
+
+	std::vector<std::string> lines;
+
+	extern const Hsm::State Lamp;
+	extern const Hsm::State Off;
+	extern const Hsm::State On;
+
+	const Hsm::State Lamp
+	{
+		Name("Lamp")
+		.Initially(StartIn(Off))
+	};
+
+	const Hsm::State Off
+	{
+		Name("Off").Parent(Lamp)
+		.Always(When(Event::Toggle).Goto(On))
+	};
+
+	const Hsm::State On
+	{
+		Name("On").Parent(Lamp)
+		.Always(When(Event::Toggle).Goto(Off))
+	};
+
+	Hsm::Log LogAs(int number)
+	{
+		return [number](const char* format, va_list args) {
+			char text[128];
+			vsnprintf(text, sizeof(text), format, args);
+			lines.push_back(std::to_string(number) + " " + text);
+		};
+	}
+}
+
+bool Test_ParallelDispatch()
+{
+	using Event = Door::Event;
+
+	LeanHsm::StateGraph<Event> graph(Door::Exists);
+	std::vector<Door> doors(64);
+	LeanHsm::Population<Event> population(graph);
+	for (auto& door : doors)
+	{
+		population.Add(door.GetStateMachine());
+	}
+	for (size_t i = 0; i < doors.size(); i += 2)
+	{
+		doors[i].HandleEvent(Event::Lock);
+	}
+
+	// Actions only record commands while dispatching in parallel
+	std::vector<Door::CommandBuffer> buffers(4);
+	REQUIRE_TRUE(population.DispatchParallel(Event::Open, buffers) == doors.size());
+	REQUIRE_TRUE(doors[1].IsInState(Door::Opened));
+	REQUIRE_TRUE(doors[1].GetCurrentEffect() == "");
+	REQUIRE_TRUE(population.CountIn(Door::Opened) == doors.size() / 2);
+	REQUIRE_TRUE(population.CountIn(Door::Locked) == doors.size() / 2);
+
+	// Commands are applied in order of instance id
+	Door* lastDoor = nullptr;
+	bool inOrder = true;
+	Door::CommandBuffer::ApplyInOrder(buffers, [&](const Door::Command& command) {
+		inOrder &= lastDoor <= command.door;
+		lastDoor = command.door;
+		Door::Apply(command);
+	});
+	REQUIRE_TRUE(inOrder);
+	REQUIRE_TRUE(doors[0].GetCurrentEffect() == "RattleLockedDoor");
+	REQUIRE_TRUE(doors[1].GetCurrentEffect() == "OpeningDoor");
+	REQUIRE_TRUE(buffers[0].Size() == 0);
+
+	// Log entries are written afterwards, on this thread, in order of instance id
+	LeanHsm::StateGraph<LampTest::Event> lampGraph(LampTest::Lamp);
+	std::vector<std::unique_ptr<TestMachine<LampTest::Event>>> lamps;
+	LeanHsm::Population<LampTest::Event> lampPopulation(lampGraph);
+	for (int i = 0; i < 16; ++i)
+	{
+		lamps.emplace_back(new TestMachine<LampTest::Event>(LampTest::Lamp, LampTest::LogAs(i)));
+		lampPopulation.Add(*lamps.back());
+	}
+	LampTest::lines.clear();
+	std::vector<LeanHsm::CommandBuffer<int>> lampBuffers(4);
+	REQUIRE_TRUE(lampPopulation.DispatchParallel(LampTest::Event::Toggle, lampBuffers) == lamps.size());
+	REQUIRE_TRUE(LampTest::lines.size() == 2 * lamps.size());
+	for (size_t i = 0; i < LampTest::lines.size(); ++i)
+	{
+		REQUIRE_TRUE(LampTest::lines[i].find(std::to_string(i / 2) + " ") == 0);
+	}
+	REQUIRE_TRUE(LampTest::lines[1] == "0 transition Off -> On");
+
+	return true; // passed all requirements
+}
+
+bool Test_Scheduler()
+{
+	using Event = Door::Event;
+	using ActiveDoor = LeanHsm::ActiveMachine<Event>;
+
+	std::vector<Door> doors(16);
+	std::vector<std::unique_ptr<ActiveDoor>> activeDoors;
+	LeanHsm::Scheduler scheduler(3, 2);
+	for (auto& door : doors)
+	{
+		activeDoors.emplace_back(new ActiveDoor(door.GetStateMachine(), 8));
+		scheduler.Attach(*activeDoors.back());
+	}
+
+	// Each machine handles its events in the order they were posted
+	for (auto& active : activeDoors)
+	{
+		REQUIRE_TRUE(active->Post(Event::Lock) == LeanHsm::PostResult::Accepted);
+		REQUIRE_TRUE(active->Post(Event::Open) == LeanHsm::PostResult::Accepted);
+		REQUIRE_TRUE(active->Post(Event::Unlock) == LeanHsm::PostResult::Accepted);
+		REQUIRE_TRUE(active->Post(Event::Lock) == LeanHsm::PostResult::Accepted);
+		REQUIRE_TRUE(active->Post(Event::Open) == LeanHsm::PostResult::Accepted);
+	}
+	scheduler.WaitIdle();
+	for (auto& door : doors)
+	{
+		REQUIRE_TRUE(door.IsInState(Door::Locked));
+		REQUIRE_TRUE(door.GetCurrentEffect() == "RattleLockedDoor");
+	}
+
+	for (auto& active : activeDoors)
+	{
+		REQUIRE_TRUE(active->Post(Event::Unlock) == LeanHsm::PostResult::Accepted);
+	}
+	scheduler.WaitIdle();
+	for (auto& door : doors)
+	{
+		REQUIRE_TRUE(door.IsInState(Door::Unlocked));
+	}
+
+	return true; // passed all requirements
+}
+
+bool Test_Messaging()
+{
+	using Event = Door::Event;
+	struct Knock { int count; };
+
+	Door door;
+	LeanHsm::ActiveMachine<Event> mailbox(door.GetStateMachine(), 4);
+	LeanHsm::PayloadSlab slab(sizeof(Knock), 1);
+
+	// Actions (and hooks) see the payload while its event is handled
+	int knocks = 0;
+	door.GetStateMachine().AddCommitHook([&](Door::Hsm& hsm, const Door::Hsm::Commit&) {
+		if (auto knock = hsm.EventPayload<Knock>())
+		{
+			knocks += knock->count;
+		}
+	});
+
+	auto payload = slab.Make<Knock>(3);
+	REQUIRE_TRUE(payload);
+	REQUIRE_FALSE(slab.Make<Knock>(1)); // the only block is in use
+	REQUIRE_TRUE(mailbox.Post(Event::Lock, std::move(payload)) == LeanHsm::PostResult::Accepted);
+	REQUIRE_FALSE(payload);
+	REQUIRE_TRUE(mailbox.Post(Event::Open) == LeanHsm::PostResult::Accepted);
+	REQUIRE_TRUE(door.IsInState(Door::Unlocked)); // nothing is handled until run
+
+	REQUIRE_FALSE(mailbox.Run(8));
+	REQUIRE_TRUE(door.IsInState(Door::Locked));
+	REQUIRE_TRUE(door.GetCurrentEffect() == "RattleLockedDoor");
+	REQUIRE_TRUE(knocks == 3);
+
+	// The block was returned to the slab after the event was handled
+	REQUIRE_TRUE(slab.Make<Knock>(1));
+
+	return true; // passed all requirements
+}
+
+bool Test_QueuePolicies()
+{
+	using Event = Door::Event;
+	using LeanHsm::PostResult;
+	using LeanHsm::QueuePolicy;
+
+	Door rejecting;
+	LeanHsm::ActiveMachine<Event> rejectQueue(rejecting.GetStateMachine(), 2, QueuePolicy::Reject);
+	REQUIRE_TRUE(rejectQueue.Post(Event::Lock) == PostResult::Accepted);
+	REQUIRE_TRUE(rejectQueue.Post(Event::Unlock) == PostResult::Accepted);
+	REQUIRE_TRUE(rejectQueue.Post(Event::Open) == PostResult::Rejected);
+	rejectQueue.Run(8);
+	REQUIRE_TRUE(rejecting.IsInState(Door::Unlocked));
+	REQUIRE_TRUE(rejectQueue.Stats().accepted == 2 && rejectQueue.Stats().rejected == 1);
+
+	Door dropping;
+	LeanHsm::ActiveMachine<Event> dropQueue(dropping.GetStateMachine(), 2, QueuePolicy::DropOldest);
+	REQUIRE_TRUE(dropQueue.Post(Event::Lock) == PostResult::Accepted);
+	REQUIRE_TRUE(dropQueue.Post(Event::Open) == PostResult::Accepted);
+	REQUIRE_TRUE(dropQueue.Post(Event::Open) == PostResult::DroppedOldest); // drops Lock
+	dropQueue.Run(8);
+	REQUIRE_TRUE(dropping.IsInState(Door::Opened));
+	REQUIRE_TRUE(dropQueue.Stats().droppedOldest == 1);
+
+	Door coalescing;
+	LeanHsm::ActiveMachine<Event> coalesceQueue(coalescing.GetStateMachine(), 4, QueuePolicy::Coalesce);
+	REQUIRE_TRUE(coalesceQueue.Post(Event::Open) == PostResult::Accepted);
+	REQUIRE_TRUE(coalesceQueue.Post(Event::Close) == PostResult::Accepted);
+	REQUIRE_TRUE(coalesceQueue.Post(Event::Open) == PostResult::Accepted); // not at the tail
+	for (int i = 0; i < 10; ++i)
+	{
+		REQUIRE_TRUE(coalesceQueue.Post(Event::Open) == PostResult::Coalesced);
+	}
+	coalesceQueue.Run(8);
+	REQUIRE_TRUE(coalescing.IsInState(Door::Opened)); // opened, closed, and opened again
+	REQUIRE_TRUE(coalesceQueue.Stats().coalesced == 10);
+	REQUIRE_TRUE(coalesceQueue.Post(Event::Open) == PostResult::Accepted); // no longer pending
+
+	return true; // passed all requirements
+}
+
+bool Test_PriorityLanes()
+{
+	using Event = Door::Event;
+	using LeanHsm::PostResult;
+	using LeanHsm::Priority;
+
+	Door door;
+	LeanHsm::ActiveMachine<Event> active(door.GetStateMachine(), 4);
+
+	// A full lane does not block the other lanes
+	for (int i = 0; i < 4; ++i)
+	{
+		REQUIRE_TRUE(active.Post(Event::Close, Priority::Background) == PostResult::Accepted);
+	}
+	REQUIRE_TRUE(active.Post(Event::Close, Priority::Background) == PostResult::Rejected);
+	REQUIRE_TRUE(active.Post(Event::Open) == PostResult::Accepted);
+	REQUIRE_TRUE(active.Post(Event::Lock, Priority::Critical) == PostResult::Accepted);
+
+	// The critical Lock goes first, so the normal Open only rattles the door
+	REQUIRE_TRUE(active.Run(1));
+	REQUIRE_TRUE(door.IsInState(Door::Locked));
+	REQUIRE_TRUE(active.Run(1));
+	REQUIRE_TRUE(door.GetCurrentEffect() == "RattleLockedDoor");
+	REQUIRE_FALSE(active.Run(8));
+
+	return true; // passed all requirements
+}
+
+bool Test_Drain()
+{
+	using Event = Door::Event;
+	using LeanHsm::DrainClock;
+
+	Door doors[2];
+	LeanHsm::ActiveMachine<Event> first(doors[0].GetStateMachine(), 4);
+	LeanHsm::ActiveMachine<Event> second(doors[1].GetStateMachine(), 4);
+	for (auto active : { &first, &second })
+	{
+		active->Post(Event::Lock);
+		active->Post(Event::Unlock);
+		active->Post(Event::Open);
+	}
+
+	// Nothing is dispatched once the deadline has passed
+	auto result = LeanHsm::DrainUntil(first, DrainClock::now() - std::chrono::seconds(1));
+	REQUIRE_TRUE(result.handled == 0 && result.remaining == 3);
+
+	LeanHsm::DrainGroup group;
+	group.Add(first);
+	group.Add(second);
+
+	// The event budget is shared fairly between the machines
+	result = group.DrainBudget(3, std::chrono::seconds(10));
+	REQUIRE_TRUE(result.handled == 3 && result.remaining == 3);
+	REQUIRE_TRUE(doors[0].IsInState(Door::Unlocked));
+	REQUIRE_TRUE(doors[1].IsInState(Door::Locked));
+
+	// The next call resumes with the second machine
+	result = group.DrainBudget(1, std::chrono::seconds(10));
+	REQUIRE_TRUE(result.handled == 1 && result.remaining == 2);
+	REQUIRE_TRUE(doors[1].IsInState(Door::Unlocked));
+
+	result = group.DrainBudget(100, std::chrono::seconds(10));
+	REQUIRE_TRUE(result.handled == 2 && result.remaining == 0);
+	REQUIRE_TRUE(doors[0].IsInState(Door::Opened) && doors[1].IsInState(Door::Opened));
+
+	return true; // passed all requirements
+}
+
+namespace
+{
+	LeanHsm::ActiveMachine<Door::Event>* gSignalTarget = nullptr;
+
+	void OnLockSignal(int)
+	{
+		gSignalTarget->PostFromSignal(Door::Event::Lock);
+	}
+}
+
+bool Test_SignalPosting()
+{
+	using Event = Door::Event;
+
+	Door door;
+	LeanHsm::ActiveMachine<Event> active(door.GetStateMachine(), 4);
+	REQUIRE_FALSE(active.PostFromSignal(Event::Lock)); // not enabled yet
+	active.EnableSignalPosting();
+	gSignalTarget = &active;
+
+	auto previousHandler = std::signal(SIGINT, OnLockSignal);
+	std::raise(SIGINT);
+	std::signal(SIGINT, previousHandler);
+	REQUIRE_TRUE(door.IsInState(Door::Unlocked));
+	REQUIRE_TRUE(active.HasPending());
+
+	// Signal events are dispatched ahead of normal events
+	active.Post(Event::Open);
+	REQUIRE_FALSE(active.Run(8));
+	REQUIRE_TRUE(door.IsInState(Door::Locked));
+	REQUIRE_TRUE(door.GetCurrentEffect() == "RattleLockedDoor");
+
+	// Signal events wait in the inbox while the critical lane is full
+	for (auto e : { Event::Unlock, Event::Open, Event::Close, Event::Open })
+	{
+		REQUIRE_TRUE(active.Post(e, LeanHsm::Priority::Critical) == LeanHsm::PostResult::Accepted);
+	}
+	REQUIRE_TRUE(active.PostFromSignal(Event::Close));
+	REQUIRE_TRUE(active.Run(0));
+	REQUIRE_TRUE(active.PendingCount() == 5);
+	REQUIRE_TRUE(active.Run(8));
+	REQUIRE_TRUE(door.IsInState(Door::Opened));
+	REQUIRE_FALSE(active.Run(8));
+	REQUIRE_TRUE(door.IsInState(Door::Unlocked));
+
+	// Signal events wake a scheduler, without any other posts
+	Door scheduled;
+	LeanHsm::ActiveMachine<Event> wakeable(scheduled.GetStateMachine(), 4);
+	wakeable.EnableSignalPosting();
+	LeanHsm::Scheduler scheduler(1, 8);
+	scheduler.Attach(wakeable);
+	gSignalTarget = &wakeable;
+	previousHandler = std::signal(SIGINT, OnLockSignal);
+	std::raise(SIGINT);
+	std::signal(SIGINT, previousHandler);
+	for (int i = 0; i < 200 && !scheduled.GetStateMachine().IsInStateSnapshot(Door::Locked); ++i)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	}
+	REQUIRE_TRUE(scheduled.GetStateMachine().IsInStateSnapshot(Door::Locked));
+	scheduler.WaitIdle();
+
+	gSignalTarget = nullptr;
+	return true; // passed all requirements
+}
+
+bool Test_SharedStatePool()
+{
+	using Event = Door::Event;
+
+	LeanHsm::StateGraph<Event> graph(Door::Exists);
+	Door doors[3];
+	LeanHsm::SharedStatePool<Event> pool(graph);
+	REQUIRE_TRUE(pool.Create("LeanHsmTest_Doors", 8));
+	for (uint32_t i = 0; i < 3; ++i)
+	{
+		REQUIRE_TRUE(pool.Attach(i, doors[i].GetStateMachine()));
+	}
+	REQUIRE_FALSE(pool.Attach(8, doors[0].GetStateMachine()));
+
+	// A view maps the segment separately, as another process would
+	LeanHsm::SharedStateView view;
+	REQUIRE_TRUE(view.Open("LeanHsmTest_Doors"));
+	REQUIRE_TRUE(view.Fingerprint() == graph.Fingerprint());
+	REQUIRE_TRUE(view.StateCount() == graph.StateCount());
+	REQUIRE_TRUE(view.InstanceCount() == 3);
+
+	auto locked = graph.IndexOf(Door::Locked);
+	auto closed = graph.IndexOf(Door::Closed);
+	REQUIRE_TRUE(std::string(view.StateName(locked)) == "Locked");
+	REQUIRE_FALSE(view.IsInState(1, locked));
+
+	REQUIRE_TRUE(doors[1].HandleEvent(Event::Lock));
+	REQUIRE_TRUE(doors[2].HandleEvent(Event::Open));
+	REQUIRE_TRUE(view.IsInState(1, locked));
+	REQUIRE_TRUE(view.IsInState(1, closed));
+	REQUIRE_TRUE(view.IsInState(0, closed));
+	REQUIRE_FALSE(view.IsInState(2, closed));
+	REQUIRE_TRUE(&graph.StateAt(view.StateIndexOf(2)) == &Door::Opened);
+
+	return true; // passed all requirements
+}
+
+bool Test_SharedEventRing()
+{
+	using Event = Door::Event;
+
+	LeanHsm::StateGraph<Event> graph(Door::Exists);
+	Door doors[2];
+	LeanHsm::Population<Event> population(graph);
+	population.Add(doors[0].GetStateMachine());
+	population.Add(doors[1].GetStateMachine());
+
+	LeanHsm::SharedEventRing consumer;
+	REQUIRE_TRUE(consumer.Create("LeanHsmTest_DoorEvents", 4, 16));
+	LeanHsm::SharedEventRing producer; // as another process would
+	REQUIRE_TRUE(producer.Open("LeanHsmTest_DoorEvents"));
+	REQUIRE_FALSE(consumer.Wait(0));
+
+	// Payloads are copied into the ring, and read by the consumer in place
+	const char knock[] = "knock";
+	REQUIRE_TRUE(producer.Post(1, uint32_t(Event::Lock)));
+	REQUIRE_TRUE(producer.Post(0, uint32_t(Event::Open), knock, sizeof(knock)));
+	const char tooLarge[17] = {};
+	REQUIRE_FALSE(producer.Post(0, uint32_t(Event::Open), tooLarge, sizeof(tooLarge)));
+	REQUIRE_TRUE(consumer.Wait(0));
+
+	std::string payloadSeen;
+	doors[0].GetStateMachine().AddCommitHook([&](Door::Hsm& hsm, const Door::Hsm::Commit&) {
+		if (auto payload = hsm.EventPayload<LeanHsm::RawPayload>())
+		{
+			payloadSeen = static_cast<const char*>(payload->data);
+		}
+	});
+	REQUIRE_TRUE(LeanHsm::DispatchIngress(consumer, population, 16) == 2);
+	REQUIRE_TRUE(doors[1].IsInState(Door::Locked));
+	REQUIRE_TRUE(doors[0].IsInState(Door::Opened));
+	REQUIRE_TRUE(payloadSeen == "knock");
+	REQUIRE_TRUE(consumer.Empty());
+
+	// A waiting consumer is woken by a post
+	std::atomic<bool> woken{ false };
+	std::thread waiter([&] { woken = consumer.Wait(10000); });
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	REQUIRE_TRUE(producer.Post(0, uint32_t(Event::Close)));
+	waiter.join();
+	REQUIRE_TRUE(woken);
+	REQUIRE_TRUE(LeanHsm::DispatchIngress(consumer, population, 16) == 1);
+	REQUIRE_TRUE(doors[0].IsInState(Door::Unlocked));
+
+	// Records with unknown events or instances are consumed, but rejected
+	REQUIRE_TRUE(producer.Post(0, 1000));
+	REQUIRE_TRUE(producer.Post(7, uint32_t(Event::Open)));
+	REQUIRE_TRUE(LeanHsm::DispatchIngress(consumer, population, 16) == 2);
+	REQUIRE_TRUE(consumer.RejectedCount() == 2);
+	REQUIRE_TRUE(doors[0].IsInState(Door::Unlocked));
+
+	return true; // passed all requirements
+}
+
+bool Test_Journal()
+{
+	using Event = Door::Event;
+	using Doors = LeanHsm::Population<Event>;
+	const std::string journalPath = "LeanHsmTest.journal";
+	const std::string snapshotPath = "LeanHsmTest.snapshot";
+	std::remove(journalPath.c_str());
+	std::remove(snapshotPath.c_str());
+
+	LeanHsm::StateGraph<Event> graph(Door::Exists);
+	{
+		Door doors[3];
+		Doors population(graph);
+		for (auto& door : doors)
+		{
+			population.Add(door.GetStateMachine());
+		}
+		LeanHsm::TransitionJournal journal;
+		REQUIRE_TRUE(journal.Open(journalPath, 4, std::chrono::milliseconds(1)));
+		REQUIRE_TRUE(LeanHsm::JournalTransitions(journal, population));
+
+		REQUIRE_TRUE(doors[0].HandleEvent(Event::Open));
+		REQUIRE_TRUE(journal.WaitDurable(journal.AppendedSequence()));
+		REQUIRE_TRUE(LeanHsm::WriteSnapshot(snapshotPath, population, journal));
+
+		REQUIRE_TRUE(doors[1].HandleEvent(Event::Lock));
+		REQUIRE_TRUE(doors[0].HandleEvent(Event::Close));
+		REQUIRE_TRUE(doors[0].HandleEvent(Event::Lock));
+		REQUIRE_TRUE(journal.AppendedSequence() == 4);
+		REQUIRE_TRUE(journal.WaitDurable(4));
+		REQUIRE_TRUE(journal.DurableSequence() == 4);
+	}
+
+	// Simulate a torn write at the end of the journal
+	if (auto file = std::fopen(journalPath.c_str(), "ab"))
+	{
+		const char torn[7] = { 1, 2, 3, 4, 5, 6, 7 };
+		std::fwrite(torn, sizeof(torn), 1, file);
+		std::fclose(file);
+	}
+
+	LeanHsm::RecoveredStates recovered;
+	REQUIRE_FALSE(LeanHsm::Recover(snapshotPath, journalPath, graph.Fingerprint() + 1, recovered));
+	REQUIRE_TRUE(LeanHsm::Recover(snapshotPath, journalPath, graph.Fingerprint(), recovered));
+	REQUIRE_TRUE(recovered.sequence == 4);
+
+	Door doors[3];
+	Doors population(graph);
+	for (auto& door : doors)
+	{
+		population.Add(door.GetStateMachine());
+	}
+	REQUIRE_TRUE(LeanHsm::RestoreStates(population, recovered));
+	REQUIRE_TRUE(doors[0].IsInState(Door::Locked));
+	REQUIRE_TRUE(doors[1].IsInState(Door::Locked));
+	REQUIRE_TRUE(doors[2].IsInState(Door::Unlocked));
+	REQUIRE_TRUE(population.CountIn(Door::Locked) == 2);
+
+	// Reopening continues the sequence, and truncates the torn tail
+	{
+		LeanHsm::TransitionJournal journal;
+		REQUIRE_TRUE(journal.Open(journalPath, 4, std::chrono::milliseconds(1)));
+		REQUIRE_TRUE(journal.AppendedSequence() == 4);
+		long size = -1;
+		if (auto file = std::fopen(journalPath.c_str(), "rb"))
+		{
+			std::fseek(file, 0, SEEK_END);
+			size = std::ftell(file);
+			std::fclose(file);
+		}
+		REQUIRE_TRUE(size == long(4 * sizeof(LeanHsm::JournalRecord)));
+		REQUIRE_FALSE(journal.Failed());
+		REQUIRE_TRUE(LeanHsm::JournalTransitions(journal, population));
+		REQUIRE_TRUE(doors[2].HandleEvent(Event::Open));
+	}
+
+	// The journal removed its hooks when it was destroyed
+	REQUIRE_TRUE(doors[2].HandleEvent(Event::Close));
+	REQUIRE_TRUE(LeanHsm::Recover(snapshotPath, journalPath, graph.Fingerprint(), recovered));
+	REQUIRE_TRUE(recovered.sequence == 5);
+	REQUIRE_TRUE(recovered.states[2] == graph.IndexOf(Door::Opened));
+
+	std::remove(journalPath.c_str());
+	std::remove(snapshotPath.c_str());
+	return true;
+}
+
+bool Test_Replay()
+{
+	using Event = Door::Event;
+	using Doors = LeanHsm::Population<Event>;
+	using ReplayMode = Door::Hsm::ReplayMode;
+	const std::string journalPath = "LeanHsmTest_Replay.journal";
+	const std::string snapshotPath = "LeanHsmTest_Replay.snapshot";
+	std::remove(journalPath.c_str());
+	std::remove(snapshotPath.c_str());
+
+	LeanHsm::StateGraph<Event> graph(Door::Exists);
+	{
+		Door doors[4];
+		Doors population(graph);
+		for (auto& door : doors)
+		{
+			population.Add(door.GetStateMachine());
+		}
+		LeanHsm::TransitionJournal journal;
+		REQUIRE_TRUE(journal.Open(journalPath, 8, std::chrono::milliseconds(1)));
+		REQUIRE_TRUE(LeanHsm::JournalTransitions(journal, population));
+
+		REQUIRE_TRUE(doors[3].HandleEvent(Event::Open));
+		REQUIRE_TRUE(journal.WaitDurable(journal.AppendedSequence()));
+		REQUIRE_TRUE(LeanHsm::WriteSnapshot(snapshotPath, population, journal));
+
+		REQUIRE_TRUE(doors[0].HandleEvent(Event::Lock));
+		REQUIRE_TRUE(doors[0].HandleEvent(Event::Open)); // rattles, an internal transition
+		REQUIRE_TRUE(doors[1].HandleEvent(Event::Open));
+		REQUIRE_TRUE(doors[2].HandleEvent(Event::Lock));
+		REQUIRE_TRUE(doors[2].HandleEvent(Event::Unlock));
+		REQUIRE_TRUE(journal.WaitDurable(journal.AppendedSequence()));
+	}
+
+	// Replay-safe actions restore the effects, without playing them again
+	{
+		Door doors[4];
+		Doors population(graph);
+		for (auto& door : doors)
+		{
+			population.Add(door.GetStateMachine());
+		}
+		LeanHsm::ReplayStats stats;
+		REQUIRE_TRUE(LeanHsm::Replay(snapshotPath, journalPath, population, 2, ReplayMode::ReplaySafeActions, stats));
+		REQUIRE_TRUE(stats.sequence == 6);
+		REQUIRE_TRUE(stats.replayed == 5);
+		REQUIRE_TRUE(stats.diverged == 0);
+		REQUIRE_TRUE(doors[0].IsInState(Door::Locked));
+		REQUIRE_TRUE(doors[0].GetCurrentEffect() == "RattleLockedDoor");
+		REQUIRE_TRUE(doors[1].IsInState(Door::Opened));
+		REQUIRE_TRUE(doors[2].IsInState(Door::Unlocked));
+		REQUIRE_TRUE(doors[2].GetCurrentEffect() == "UnlockingDoor");
+		REQUIRE_TRUE(doors[3].IsInState(Door::Opened));
+		REQUIRE_TRUE(population.CountIn(Door::Closed) == 2);
+		REQUIRE_FALSE(doors[0].GetStateMachine().IsReplaying());
+	}
+
+	// Suppressed actions only rebuild the states
+	{
+		Door doors[4];
+		Doors population(graph);
+		for (auto& door : doors)
+		{
+			population.Add(door.GetStateMachine());
+		}
+		LeanHsm::ReplayStats stats;
+		REQUIRE_TRUE(LeanHsm::Replay(snapshotPath, journalPath, population, 3, ReplayMode::SuppressActions, stats));
+		REQUIRE_TRUE(stats.diverged == 0);
+		REQUIRE_TRUE(doors[0].IsInState(Door::Locked));
+		REQUIRE_TRUE(doors[0].GetCurrentEffect().empty());
+		REQUIRE_TRUE(population.CountIn(Door::Opened) == 2);
+	}
+
+	std::remove(journalPath.c_str());
+	std::remove(snapshotPath.c_str());
+	return true;
+}
+
+bool Test_Fork()
+{
+	using Event = Door::Event;
+
+	LeanHsm::StateGraph<Event> graph(Door::Exists);
+	Door doors[3];
+	LeanHsm::Population<Event> population(graph);
+	for (auto& door : doors)
+	{
+		population.Add(door.GetStateMachine());
+	}
+
+	// A fork handles hypothetical events without affecting the original
+	auto fork = doors[0].GetStateMachine().Fork();
+	REQUIRE_TRUE(fork.IsReplaying());
+	REQUIRE_TRUE(fork.HandeleEvent(Event::Lock));
+	REQUIRE_TRUE(fork.IsInState(Door::Locked));
+	REQUIRE_TRUE(fork.HandeleEvent(Event::Open));
+	REQUIRE_TRUE(fork.IsInState(Door::Locked));
+	REQUIRE_TRUE(doors[0].IsInState(Door::Unlocked));
+	REQUIRE_TRUE(doors[0].GetCurrentEffect().empty());
+	REQUIRE_TRUE(population.CountIn(Door::Locked) == 0);
+
+	// Configurations are saved and restored without actions
+	auto saved = doors[1].GetStateMachine().SaveConfiguration();
+	REQUIRE_TRUE(doors[1].HandleEvent(Event::Open));
+	doors[1].GetStateMachine().RestoreConfiguration(saved);
+	REQUIRE_TRUE(doors[1].IsInState(Door::Unlocked));
+	REQUIRE_TRUE(doors[1].GetCurrentEffect() == "OpeningDoor");
+	REQUIRE_TRUE(population.CountIn(Door::Opened) == 0);
+
+	// Populations are rewound in bulk
+	std::vector<LeanHsm::Population<Event>::Configuration> frame;
+	population.SaveStates(frame);
+	REQUIRE_TRUE(doors[0].HandleEvent(Event::Lock));
+	REQUIRE_TRUE(doors[2].HandleEvent(Event::Open));
+	REQUIRE_TRUE(population.CountIn(Door::Closed) == 2);
+	REQUIRE_TRUE(population.RewindStates(frame) == 2);
+	REQUIRE_TRUE(population.CountIn(Door::Unlocked) == 3);
+	REQUIRE_TRUE(doors[0].IsInState(Door::Unlocked));
+	REQUIRE_TRUE(doors[2].IsInState(Door::Unlocked));
+	REQUIRE_TRUE(population.RewindStates(frame) == 0);
+	return true;
+}
+
+bool Test_ConfigurationHash()
+{
+	using Event = Door::Event;
+	using Doors = LeanHsm::Population<Event>;
+
+	// Two peers handle the same events in lockstep
+	LeanHsm::StateGraph<Event> graph(Door::Exists);
+	Door peerA[3];
+	Door peerB[3];
+	Doors populationA(graph);
+	Doors populationB(graph);
+	for (int i = 0; i < 3; ++i)
+	{
+		populationA.Add(peerA[i].GetStateMachine());
+		populationB.Add(peerB[i].GetStateMachine());
+	}
+	REQUIRE_TRUE(populationA.Checksum() == populationB.Checksum());
+
+	auto& sm = peerA[0].GetStateMachine();
+	auto unlocked = sm.ConfigurationHash();
+	REQUIRE_TRUE(unlocked == (Door::Exists.key ^ Door::Closed.key ^ Door::Unlocked.key));
+	REQUIRE_TRUE(peerA[0].HandleEvent(Event::Lock));
+	REQUIRE_TRUE(sm.ConfigurationHash() == (Door::Exists.key ^ Door::Closed.key ^ Door::Locked.key));
+	REQUIRE_TRUE(peerA[0].HandleEvent(Event::Open)); // internal transition
+	REQUIRE_TRUE(sm.ConfigurationHash() == (Door::Exists.key ^ Door::Closed.key ^ Door::Locked.key));
+	REQUIRE_TRUE(populationA.Checksum() != populationB.Checksum());
+
+	REQUIRE_TRUE(peerB[0].HandleEvent(Event::Lock));
+	REQUIRE_TRUE(populationA.Checksum() == populationB.Checksum());
+
+	// Instances swapping states is a desync
+	REQUIRE_TRUE(peerA[0].HandleEvent(Event::Unlock));
+	REQUIRE_TRUE(sm.ConfigurationHash() == unlocked);
+	REQUIRE_TRUE(peerA[1].HandleEvent(Event::Lock));
+	REQUIRE_TRUE(populationA.Checksum() != populationB.Checksum());
+
+	// Restores, forks and parallel dispatch keep the hashes up to date
+	populationA.Instance(1).Restore(Door::Unlocked);
+	populationA.Instance(0).Restore(Door::Locked);
+	REQUIRE_TRUE(populationA.Checksum() == populationB.Checksum());
+	REQUIRE_TRUE(sm.Fork().ConfigurationHash() == sm.ConfigurationHash());
+
+	std::vector<Door::CommandBuffer> buffersA(2);
+	std::vector<Door::CommandBuffer> buffersB(3);
+	populationA.DispatchParallel(Event::Open, buffersA);
+	populationB.DispatchAll(Event::Open);
+	REQUIRE_TRUE(populationA.Checksum() == populationB.Checksum());
+	REQUIRE_TRUE(peerA[2].GetStateMachine().ConfigurationHash() == (Door::Exists.key ^ Door::Opened.key));
+	return true;
+}
+
+bool Test_Reachability()
+{
+	using Event = Door::Event;
+
+	LeanHsm::StateGraph<Event> graph(Door::Exists, 2);
+	auto exists = graph.IndexOf(Door::Exists);
+	auto unlocked = graph.IndexOf(Door::Unlocked);
+	auto locked = graph.IndexOf(Door::Locked);
+	auto opened = graph.IndexOf(Door::Opened);
+	REQUIRE_TRUE(graph.Events().size() == 4);
+
+	// Closing comes to rest in Unlocked, via Closed's initial transition
+	REQUIRE_TRUE(graph.NextState(opened, Event::Close) == unlocked);
+	REQUIRE_TRUE(graph.NextState(locked, Event::Open) == locked);
+	REQUIRE_TRUE(graph.NextState(opened, Event::Lock) == LeanHsm::StateGraph<Event>::InvalidIndex);
+
+	REQUIRE_TRUE(graph.CanReach(locked, opened));
+	REQUIRE_TRUE(graph.CanReach(opened, locked));
+	REQUIRE_TRUE(graph.CanReach(exists, exists));
+	REQUIRE_FALSE(graph.CanReach(exists, locked));
+	REQUIRE_FALSE(graph.CanReach(locked, exists));
+
+	// Machines never rest in Closed, which always enters a child
+	REQUIRE_FALSE(graph.CanReach(graph.IndexOf(Door::Closed), opened));
+	REQUIRE_FALSE(graph.CanReach(opened, graph.IndexOf(Door::Closed)));
+
+	std::vector<Event> path;
+	REQUIRE_TRUE(graph.ShortestPath(locked, opened, path));
+	REQUIRE_TRUE(path == (std::vector<Event>{ Event::Unlock, Event::Open }));
+	REQUIRE_TRUE(graph.ShortestPath(opened, locked, path));
+	REQUIRE_TRUE(path == (std::vector<Event>{ Event::Close, Event::Lock }));
+	REQUIRE_TRUE(graph.ShortestPath(unlocked, unlocked, path));
+	REQUIRE_TRUE(path.empty());
+	REQUIRE_FALSE(graph.ShortestPath(exists, opened, path));
+
+	// The path works on a real door
+	Door door;
+	REQUIRE_TRUE(door.HandleEvent(Event::Lock));
+	REQUIRE_TRUE(graph.ShortestPath(graph.IndexOf(door.GetStateMachine().CurrentState()), opened, path));
+	for (auto e : path)
+	{
+		REQUIRE_TRUE(door.HandleEvent(e));
+	}
+	REQUIRE_TRUE(door.IsInState(Door::Opened));
+	return true;
+}
+
+bool Test_EnabledEvents()
+{
+	using Event = Door::Event;
+	auto maskOf = [](std::initializer_list<Event> events) {
+		LeanHsm::EventMask mask;
+		for (auto e : events)
+		{
+			mask.set(LeanHsm::EventIndex(e));
+		}
+		return mask;
+	};
+
+	LeanHsm::StateGraph<Event> graph(Door::Exists);
+	REQUIRE_TRUE(graph.AcceptMask(graph.IndexOf(Door::Exists)).none());
+	REQUIRE_TRUE(graph.AcceptMask(graph.IndexOf(Door::Locked)) == maskOf({ Event::Unlock, Event::Open }));
+
+	// Unbound machines walk their states, and bound machines use the graph
+	Door unbound;
+	Door bound;
+	bound.GetStateMachine().BindGraph(&graph);
+	for (auto door : { &unbound, &bound })
+	{
+		auto& sm = door->GetStateMachine();
+		REQUIRE_TRUE(sm.EnabledEvents() == maskOf({ Event::Lock, Event::Open }));
+		REQUIRE_TRUE(sm.CanHandle(Event::Lock));
+		REQUIRE_FALSE(sm.CanHandle(Event::Close));
+
+		REQUIRE_TRUE(door->HandleEvent(Event::Lock));
+		REQUIRE_TRUE(sm.EnabledEvents() == maskOf({ Event::Unlock, Event::Open }));
+		REQUIRE_TRUE(sm.CanHandle(Event::Open));
+		REQUIRE_FALSE(sm.CanHandle(Event::Lock));
+
+		REQUIRE_TRUE(door->HandleEvent(Event::Unlock));
+		REQUIRE_TRUE(door->HandleEvent(Event::Open));
+		REQUIRE_TRUE(sm.EnabledEvents() == maskOf({ Event::Close }));
+		REQUIRE_TRUE(sm.CanHandle(Event::Close));
+		REQUIRE_FALSE(sm.CanHandle(Event::Open));
+	}
+	return true;
+}
+
+bool Test_IngressFilter()
+{
+	using Event = Door::Event;
+	using LeanHsm::PostResult;
+
+	LeanHsm::StateGraph<Event> graph(Door::Exists);
+	Door door;
+	door.GetStateMachine().BindGraph(&graph);
+	LeanHsm::ActiveMachine<Event> mailbox(door.GetStateMachine(), 4);
+	mailbox.FilterIngress(true);
+
+	// Closed doors can't be closed
+	REQUIRE_TRUE(mailbox.Post(Event::Close) == PostResult::Filtered);
+	REQUIRE_TRUE(mailbox.Post(Event::Open) == PostResult::Accepted);
+	REQUIRE_TRUE(mailbox.PendingCount() == 1);
+	mailbox.Run(4);
+	REQUIRE_TRUE(door.IsInState(Door::Opened));
+	REQUIRE_TRUE(mailbox.Post(Event::Lock) == PostResult::Filtered);
+	REQUIRE_TRUE(mailbox.Post(Event::Close) == PostResult::Accepted);
+	REQUIRE_TRUE(mailbox.Stats().filtered == 2);
+	REQUIRE_TRUE(mailbox.Stats().accepted == 2);
+
+	// Populations skip the instances that can't handle the event
+	Door doors[4];
+	LeanHsm::Population<Event> population(graph);
+	for (auto& d : doors)
+	{
+		population.Add(d.GetStateMachine());
+	}
+	REQUIRE_TRUE(doors[0].HandleEvent(Event::Open));
+	REQUIRE_TRUE(population.DispatchAll(Event::Close) == 1);
+	REQUIRE_TRUE(population.FilteredCount() == 3);
+
+	std::vector<Door::CommandBuffer> buffers(2);
+	REQUIRE_TRUE(doors[1].HandleEvent(Event::Lock));
+	REQUIRE_TRUE(population.DispatchParallel(Event::Unlock, buffers) == 1);
+	REQUIRE_TRUE(population.FilteredCount() == 6);
+	REQUIRE_TRUE(population.CountIn(Door::Unlocked) == 4);
+	return true;
+}
+
+namespace GateTest
+{
+	// A gate that takes a while to open, and must not lose the events that
+	// arrive while it is moving
+	enum class Event { Open, Done, Unlock };
+	using Hsm = LeanHsm::StateMachine<Event>;
+	using Name = Hsm::Name;
+	using StartIn = Hsm::StartIn;
+	using When = Hsm::When;
+
+	int unlockCount = 0;
+	int unlockPayloadCount = 0;
+	void CountUnlock(Hsm& sm)
+	{
+		++unlockCount;
+		if (sm.EventPayload<int>())
+		{
+			++unlockPayloadCount;
+		}
+	}
+
+	extern const Hsm::State Gate;
+	extern const Hsm::State Idle;
+	extern const Hsm::State Moving;
+
+	const Hsm::State Gate
+	{
+		Name("Gate")
+		.Initially(StartIn(Idle))
+	};
+
+	const Hsm::State Idle
+	{
+		Name("Idle").Parent(Gate)
+		.Always(When(Event::Open).Goto(Moving))
+		.Always(When(Event::Unlock).Do(CountUnlock))
+	};
+
+	const Hsm::State Moving
+	{
+		Name("Moving").Parent(Gate)
+		.Defer(Event::Unlock)
+		.Defer(Event::Open)
+		.Always(When(Event::Done).Goto(Idle))
+	};
+}
+
+bool Test_Deferral()
+{
+	using GateTest::Event;
+
+	GateTest::unlockCount = 0;
+	TestMachine<GateTest::Event> sm(GateTest::Gate);
+	REQUIRE_TRUE(sm.IsInState(GateTest::Idle));
+	REQUIRE_TRUE(sm.HandeleEvent(Event::Open));
+	REQUIRE_TRUE(sm.IsInState(GateTest::Moving));
+	REQUIRE_TRUE(sm.CanHandle(Event::Unlock));
+
+	// Deferred events are handled in order once the gate stops
+	REQUIRE_TRUE(sm.HandeleEvent(Event::Unlock));
+	REQUIRE_TRUE(sm.HandeleEvent(Event::Open));
+	REQUIRE_TRUE(sm.DeferredCount() == 2);
+	REQUIRE_TRUE(GateTest::unlockCount == 0);
+	REQUIRE_TRUE(sm.HandeleEvent(Event::Done));
+	REQUIRE_TRUE(GateTest::unlockCount == 1);
+	REQUIRE_TRUE(sm.IsInState(GateTest::Moving));
+	REQUIRE_TRUE(sm.DeferredCount() == 0);
+
+	// The buffer has a fixed capacity
+	for (size_t i = 0; i < LeanHsm::MaxDeferred; ++i)
+	{
+		REQUIRE_TRUE(sm.HandeleEvent(Event::Unlock));
+	}
+	REQUIRE_FALSE(sm.HandeleEvent(Event::Unlock));
+	REQUIRE_TRUE(sm.DeferredCount() == LeanHsm::MaxDeferred);
+
+	// Forks and configurations keep the deferred events
+	auto saved = sm.SaveConfiguration();
+	auto fork = sm.Fork();
+	REQUIRE_TRUE(fork.DeferredCount() == LeanHsm::MaxDeferred);
+	REQUIRE_TRUE(sm.HandeleEvent(Event::Done));
+	REQUIRE_TRUE(GateTest::unlockCount == 1 + int(LeanHsm::MaxDeferred));
+	REQUIRE_TRUE(sm.IsInState(GateTest::Idle));
+	sm.RestoreConfiguration(saved);
+	REQUIRE_TRUE(sm.IsInState(GateTest::Moving));
+	REQUIRE_TRUE(sm.DeferredCount() == LeanHsm::MaxDeferred);
+
+	// Deferred events are accepted at ingress
+	LeanHsm::StateGraph<Event> graph(GateTest::Gate);
+	REQUIRE_TRUE(graph.AcceptMask(graph.IndexOf(GateTest::Moving)).test(LeanHsm::EventIndex(Event::Unlock)));
+	REQUIRE_TRUE(graph.NextState(graph.IndexOf(GateTest::Moving), Event::Unlock) == LeanHsm::StateGraph<Event>::InvalidIndex);
+
+	// Populations rewind deferred events, even if the state is the same
+	TestMachine<GateTest::Event> gate(GateTest::Gate);
+	LeanHsm::Population<Event> population(graph);
+	population.Add(gate);
+	REQUIRE_TRUE(gate.HandeleEvent(Event::Open));
+	std::vector<LeanHsm::Population<Event>::Configuration> frame;
+	population.SaveStates(frame);
+	REQUIRE_TRUE(gate.HandeleEvent(Event::Unlock));
+	REQUIRE_TRUE(gate.DeferredCount() == 1);
+	REQUIRE_TRUE(population.RewindStates(frame) == 1);
+	REQUIRE_TRUE(gate.DeferredCount() == 0);
+	REQUIRE_TRUE(gate.IsInState(GateTest::Moving));
+	REQUIRE_TRUE(population.RewindStates(frame) == 0);
+
+	// Recalled events don't see the payload of the event that recalled them
+	GateTest::unlockCount = 0;
+	GateTest::unlockPayloadCount = 0;
+	REQUIRE_TRUE(gate.HandeleEvent(Event::Unlock));
+	int distance = 3;
+	REQUIRE_TRUE(gate.HandleEventWithPayload(Event::Done, &distance, LeanHsm::TypeTag<int>()));
+	REQUIRE_TRUE(GateTest::unlockCount == 1);
+	REQUIRE_TRUE(GateTest::unlockPayloadCount == 0);
+
+	// Events with payloads aren't deferred without them
+	REQUIRE_TRUE(gate.HandeleEvent(Event::Open));
+	REQUIRE_FALSE(gate.HandleEventWithPayload(Event::Unlock, &distance, LeanHsm::TypeTag<int>()));
+	REQUIRE_TRUE(gate.DeferredCount() == 0);
+	REQUIRE_TRUE(gate.HandeleEvent(Event::Done));
+	REQUIRE_TRUE(GateTest::unlockCount == 1);
+	return true;
+}
+
+namespace PipelineTest
+{
+	// A pipeline that checks whether it can run as soon as it starts, and
+	// resets through a chain of pass-through states
+	enum class Event { Start, Reset, Spin };
+	using Hsm = LeanHsm::StateMachine<Event>;
+	using Name = Hsm::Name;
+	using StartIn = Hsm::StartIn;
+	using When = Hsm::When;
+	using Then = Hsm::Then;
+
+	bool ready = false;
+	int runCount = 0;
+	bool IsReady(Hsm&) { return ready; }
+	void Run(Hsm&) { ++runCount; }
+
+	extern const Hsm::State Pipeline;
+	extern const Hsm::State Idle;
+	extern const Hsm::State Check;
+	extern const Hsm::State Waiting;
+	extern const Hsm::State Running;
+	extern const Hsm::State Flush;
+	extern const Hsm::State Rewind;
+	extern const Hsm::State Spin;
+
+	const Hsm::State Pipeline
+	{
+		Name("Pipeline")
+		.Initially(StartIn(Idle))
+		.Always(When(Event::Reset).Goto(Flush))
+		.Always(When(Event::Spin).Goto(Spin))
+	};
+
+	const Hsm::State Idle
+	{
+		Name("Idle").Parent(Pipeline)
+		.Always(When(Event::Start).Goto(Check))
+	};
+
+	const Hsm::State Check
+	{
+		Name("Check").Parent(Pipeline)
+		.Always(Then(IsReady).Goto(Running))
+		.Always(Then().Goto(Waiting))
+	};
+
+	const Hsm::State Waiting
+	{
+		Name("Waiting").Parent(Pipeline)
+		.Always(When(Event::Start).Goto(Check))
+	};
+
+	const Hsm::State Running
+	{
+		Name("Running").Parent(Pipeline)
+		.OnEntry(Run)
+	};
+
+	const Hsm::State Flush
+	{
+		Name("Flush").Parent(Pipeline)
+		.Always(Then().Goto(Rewind))
+	};
+
+	const Hsm::State Rewind
+	{
+		Name("Rewind").Parent(Pipeline)
+		.Always(Then().Goto(Idle))
+	};
+
+	// completes to Idle as soon as it's entered, even when Start re-enters it
+	const Hsm::State Spin
+	{
+		Name("Spin").Parent(Pipeline)
+		.Always(Then().Goto(Idle))
+		.Always(When(Event::Start).Goto(Spin))
+	};
+}
+
+namespace CounterTest
+{
+	// A counter that fills up after three pokes, each of which re-enters it
+	enum class Event { Poke };
+	using Hsm = LeanHsm::StateMachine<Event>;
+	using Name = Hsm::Name;
+	using StartIn = Hsm::StartIn;
+	using When = Hsm::When;
+	using Then = Hsm::Then;
+
+	int pokes = 0;
+	void Poke(Hsm&) { ++pokes; }
+	bool ThreePokes(Hsm&) { return pokes >= 3; }
+
+	extern const Hsm::State Counter;
+	extern const Hsm::State Counting;
+	extern const Hsm::State Full;
+
+	const Hsm::State Counter
+	{
+		Name("Counter")
+		.Initially(StartIn(Counting))
+	};
+
+	const Hsm::State Counting
+	{
+		Name("Counting").Parent(Counter)
+		.Always(When(Event::Poke).Goto(Counting).Do(Poke))
+		.Always(Then(ThreePokes).Goto(Full))
+	};
+
+	const Hsm::State Full
+	{
+		Name("Full").Parent(Counter)
+	};
+}
+
+bool Test_Completion()
+{
+	using PipelineTest::Event;
+	using Hsm = PipelineTest::Hsm;
+
+	PipelineTest::ready = false;
+	PipelineTest::runCount = 0;
+	LeanHsm::StateGraph<Event> graph(PipelineTest::Pipeline);
+	TestMachine<PipelineTest::Event> unbound(PipelineTest::Pipeline);
+	TestMachine<PipelineTest::Event> bound(PipelineTest::Pipeline);
+	bound.BindGraph(&graph);
+	// the hooks outlive the loop, so the commits do too
+	std::vector<const Hsm::State*> commits;
+	for (auto sm : { &unbound, &bound })
+	{
+		commits.clear();
+		sm->AddCommitHook([&commits](Hsm&, const Hsm::Commit& c) { commits.push_back(c.to); });
+
+		// Guarded completions are evaluated after entry, in order
+		PipelineTest::ready = false;
+		REQUIRE_TRUE(sm->HandeleEvent(Event::Start));
+		REQUIRE_TRUE(sm->IsInState(PipelineTest::Waiting));
+		PipelineTest::ready = true;
+		REQUIRE_TRUE(sm->HandeleEvent(Event::Start));
+		REQUIRE_TRUE(sm->IsInState(PipelineTest::Running));
+
+		// Chains complete within one step
+		REQUIRE_TRUE(sm->HandeleEvent(Event::Reset));
+		REQUIRE_TRUE(sm->IsInState(PipelineTest::Idle));
+		REQUIRE_TRUE(commits.size() == 3);
+		REQUIRE_TRUE(commits[2] == &PipelineTest::Idle);
+	}
+	REQUIRE_TRUE(PipelineTest::runCount == 2);
+
+	// The graph collapses the pass-through states, and resolves unguarded completions
+	REQUIRE_TRUE(graph.CollapsedTarget(PipelineTest::Flush) == &PipelineTest::Idle);
+	REQUIRE_TRUE(graph.CollapsedTarget(PipelineTest::Check) == &PipelineTest::Check);
+	REQUIRE_TRUE(graph.CollapsedTarget(PipelineTest::Running) == &PipelineTest::Running);
+	auto idle = graph.IndexOf(PipelineTest::Idle);
+	REQUIRE_TRUE(graph.NextState(graph.IndexOf(PipelineTest::Running), Event::Reset) == idle);
+	// Guarded completions are alternatives: Start may end in either branch
+	auto waiting = graph.IndexOf(PipelineTest::Waiting);
+	auto running = graph.IndexOf(PipelineTest::Running);
+	REQUIRE_TRUE(graph.NextState(idle, Event::Start) == waiting);
+	REQUIRE_TRUE(graph.CanReach(idle, waiting));
+	REQUIRE_TRUE(graph.CanReach(idle, running));
+	std::vector<Event> path;
+	REQUIRE_TRUE(graph.ShortestPath(idle, running, path));
+	REQUIRE_TRUE(path == std::vector<Event>{ Event::Start });
+	REQUIRE_TRUE(graph.ShortestPath(waiting, running, path));
+	REQUIRE_TRUE(path == std::vector<Event>{ Event::Start });
+
+	// A chain isn't collapsed away when its end is already active
+	REQUIRE_TRUE(bound.HandeleEvent(Event::Spin));
+	REQUIRE_TRUE(bound.IsInState(PipelineTest::Idle));
+
+	// Transitions back to the state they left complete too, in the graph as well
+	REQUIRE_TRUE(graph.NextState(graph.IndexOf(PipelineTest::Spin), Event::Start) == idle);
+	LeanHsm::StateGraph<CounterTest::Event> counterGraph(CounterTest::Counter);
+	TestMachine<CounterTest::Event> unboundCounter(CounterTest::Counter);
+	TestMachine<CounterTest::Event> boundCounter(CounterTest::Counter);
+	boundCounter.BindGraph(&counterGraph);
+	for (auto sm : { &unboundCounter, &boundCounter })
+	{
+		CounterTest::pokes = 0;
+		for (int i = 0; i < 5 && sm->IsInState(CounterTest::Counting); ++i)
+		{
+			REQUIRE_TRUE(sm->HandeleEvent(CounterTest::Event::Poke));
+		}
+		REQUIRE_TRUE(sm->IsInState(CounterTest::Full));
+		REQUIRE_TRUE(CounterTest::pokes == 3);
+	}
+	return true;
+}
+
+namespace DispenserTest
+{
+	// A dispenser that chooses what to do after counting each coin, and
+	// decides whether to refund before clearing the credit
+	enum class Event { Coin, Cancel, Done };
+	using Hsm = LeanHsm::StateMachine<Event>;
+	using Name = Hsm::Name;
+	using StartIn = Hsm::StartIn;
+	using When = Hsm::When;
+	using Then = Hsm::Then;
+	using Junction = Hsm::Junction;
+	using Choice = Hsm::Choice;
+
+	int credit = 0;
+	std::vector<std::string> trace;
+	bool HasCredit(Hsm&) { return credit > 0; }
+	bool HasEnough(Hsm&) { return credit >= 2; }
+	void AddCoin(Hsm&) { ++credit; trace.push_back("coin"); }
+	void ClearCredit(Hsm&) { credit = 0; trace.push_back("clear"); }
+	void Vend(Hsm&) { credit = 0; trace.push_back("vend"); }
+	void Refund(Hsm&) { trace.push_back("refund"); }
+	void ExitPaying(Hsm&) { trace.push_back("exit Paying"); }
+
+	extern const Hsm::State Dispenser;
+	extern const Hsm::State Idle;
+	extern const Hsm::State Counting;
+	extern const Hsm::State Paying;
+	extern const Hsm::State Refunding;
+	extern const Hsm::State Vending;
+	extern const Hsm::State Restart;
+
+	const Hsm::State Dispenser
+	{
+		Name("Dispenser")
+		.Initially(StartIn(Idle))
+	};
+
+	const Hsm::State Idle
+	{
+		Name("Idle").Parent(Dispenser)
+		.Always(When(Event::Coin).Goto(Counting).Do(AddCoin))
+	};
+
+	const Hsm::State Counting
+	{
+		Choice("Counting").Parent(Dispenser)
+		.Always(Then(HasEnough).Goto(Vending).Do(Vend))
+		.Always(Then().Goto(Paying))
+	};
+
+	const Hsm::State Paying
+	{
+		Name("Paying").Parent(Dispenser)
+		.OnExit(ExitPaying)
+		.Always(When(Event::Coin).Goto(Counting).Do(AddCoin))
+		.Always(When(Event::Cancel).Goto(Refunding).Do(ClearCredit))
+	};
+
+	const Hsm::State Refunding
+	{
+		Junction("Refunding").Parent(Dispenser)
+		.Always(Then(HasCredit).Goto(Idle).Do(Refund))
+		.Always(Then().Goto(Idle))
+	};
+
+	const Hsm::State Vending
+	{
+		Name("Vending").Parent(Dispenser)
+		.Always(When(Event::Done).Goto(Restart))
+	};
+
+	// a static junction
+	const Hsm::State Restart
+	{
+		Junction("Restart").Parent(Dispenser)
+		.Always(Then().Goto(Idle))
+	};
+}
+
+bool Test_Pseudostates()
+{
+	using DispenserTest::Event;
+	using Hsm = DispenserTest::Hsm;
+	using Trace = std::vector<std::string>;
+
+	LeanHsm::StateGraph<Event> graph(DispenserTest::Dispenser);
+	TestMachine<DispenserTest::Event> unbound(DispenserTest::Dispenser);
+	TestMachine<DispenserTest::Event> bound(DispenserTest::Dispenser);
+	bound.BindGraph(&graph);
+	// the hooks outlive the loop, so the commits do too
+	std::vector<const Hsm::State*> commits;
+	for (auto sm : { &unbound, &bound })
+	{
+		commits.clear();
+		sm->AddCommitHook([&commits](Hsm&, const Hsm::Commit& c) { commits.push_back(c.to); });
+		DispenserTest::credit = 0;
+		DispenserTest::trace.clear();
+
+		// Choices are evaluated after the transition's action
+		REQUIRE_TRUE(sm->HandeleEvent(Event::Coin));
+		REQUIRE_TRUE(sm->IsInState(DispenserTest::Paying));
+		REQUIRE_TRUE(sm->HandeleEvent(Event::Coin));
+		REQUIRE_TRUE(sm->IsInState(DispenserTest::Vending));
+		REQUIRE_TRUE((DispenserTest::trace == Trace{ "coin", "exit Paying", "coin", "vend" }));
+
+		// Machines never rest in pseudostates
+		REQUIRE_TRUE(sm->HandeleEvent(Event::Done));
+		REQUIRE_TRUE(sm->IsInState(DispenserTest::Idle));
+		REQUIRE_TRUE(commits.size() == 3);
+		REQUIRE_TRUE(commits[2] == &DispenserTest::Idle);
+
+		// Junctions are evaluated before any exit or action, and their
+		// branch actions follow the transition's action
+		DispenserTest::trace.clear();
+		REQUIRE_TRUE(sm->HandeleEvent(Event::Coin));
+		REQUIRE_TRUE(sm->HandeleEvent(Event::Cancel));
+		REQUIRE_TRUE(sm->IsInState(DispenserTest::Idle));
+		REQUIRE_TRUE((DispenserTest::trace == Trace{ "coin", "exit Paying", "clear", "refund" }));
+		REQUIRE_TRUE(DispenserTest::credit == 0);
+	}
+
+	// The graph collapses static junctions, and follows every branch of the others
+	REQUIRE_TRUE(graph.CollapsedTarget(DispenserTest::Restart) == &DispenserTest::Idle);
+	REQUIRE_TRUE(graph.CollapsedTarget(DispenserTest::Refunding) == &DispenserTest::Refunding);
+	REQUIRE_TRUE(graph.CollapsedTarget(DispenserTest::Counting) == &DispenserTest::Counting);
+	auto idle = graph.IndexOf(DispenserTest::Idle);
+	auto paying = graph.IndexOf(DispenserTest::Paying);
+	REQUIRE_TRUE(graph.NextState(idle, Event::Coin) == paying);
+	REQUIRE_TRUE(graph.NextState(paying, Event::Cancel) == idle);
+	REQUIRE_TRUE(graph.NextState(graph.IndexOf(DispenserTest::Vending), Event::Done) == idle);
+
+	// Guarded branches lead somewhere too, if guards allow
+	auto vending = graph.IndexOf(DispenserTest::Vending);
+	REQUIRE_TRUE(graph.CanReach(idle, vending));
+	REQUIRE_TRUE(graph.CanReach(paying, vending));
+	REQUIRE_TRUE(graph.CanReach(vending, paying));
+	std::vector<Event> path;
+	REQUIRE_TRUE(graph.ShortestPath(idle, vending, path));
+	REQUIRE_TRUE(path == std::vector<Event>{ Event::Coin });
+	return true;
+}
+
+namespace ConsoleTest
+{
+	// A console that moves on any direction, except that Left stumbles,
+	// and ignores everything but Pause while paused
+	enum class Event { Up, Down, Left, Right, Pause, Quit };
+	using Hsm = LeanHsm::StateMachine<Event>;
+	using Name = Hsm::Name;
+	using StartIn = Hsm::StartIn;
+	using When = Hsm::When;
+
+	const LeanHsm::EventMask Directions = LeanHsm::EventRange(Event::Up, Event::Right);
+
+	int moveCount = 0;
+	int stumbleCount = 0;
+	int ignoreCount = 0;
+	void Move(Hsm&) { ++moveCount; }
+	void Stumble(Hsm&) { ++stumbleCount; }
+	void Ignore(Hsm&) { ++ignoreCount; }
+
+	extern const Hsm::State Console;
+	extern const Hsm::State Playing;
+	extern const Hsm::State Paused;
+	extern const Hsm::State Off;
+
+	const Hsm::State Console
+	{
+		Name("Console")
+		.Initially(StartIn(Playing))
+		.Always(When(Event::Quit).Goto(Off))
+	};
+
+	const Hsm::State Playing
+	{
+		Name("Playing").Parent(Console)
+		.Always(When(Event::Left).Do(Stumble))
+		.Always(When(Directions).Do(Move))
+		.Always(When(Event::Pause).Goto(Paused))
+	};
+
+	const Hsm::State Paused
+	{
+		Name("Paused").Parent(Console)
+		.Always(When(Event::Pause).Goto(Playing))
+		.Always(When(LeanHsm::AnyEvent()).Do(Ignore))
+	};
+
+	const Hsm::State Off
+	{
+		Name("Off").Parent(Console)
+	};
+}
+
+bool Test_EventSets()
+{
+	using ConsoleTest::Event;
+
+	// Sets match each of their events, in declaration order
+	ConsoleTest::moveCount = 0;
+	ConsoleTest::stumbleCount = 0;
+	ConsoleTest::ignoreCount = 0;
+	TestMachine<ConsoleTest::Event> sm(ConsoleTest::Console);
+	for (auto e : { Event::Up, Event::Down, Event::Left, Event::Right })
+	{
+		REQUIRE_TRUE(sm.HandeleEvent(e));
+	}
+	REQUIRE_TRUE(ConsoleTest::moveCount == 3);
+	REQUIRE_TRUE(ConsoleTest::stumbleCount == 1);
+
+	// A wildcard in a sub-state overrides its ancestors' transitions
+	REQUIRE_TRUE(sm.HandeleEvent(Event::Pause));
+	REQUIRE_TRUE(sm.IsInState(ConsoleTest::Paused));
+	REQUIRE_TRUE(sm.HandeleEvent(Event::Quit));
+	REQUIRE_TRUE(sm.HandeleEvent(Event::Up));
+	REQUIRE_TRUE(sm.IsInState(ConsoleTest::Paused));
+	REQUIRE_TRUE(ConsoleTest::ignoreCount == 2);
+	REQUIRE_TRUE(sm.EnabledEvents().all());
+	REQUIRE_TRUE(sm.HandeleEvent(Event::Pause));
+	REQUIRE_TRUE(sm.IsInState(ConsoleTest::Playing));
+	REQUIRE_TRUE(sm.EnabledEvents() == LeanHsm::EventSet({ Event::Up, Event::Down, Event::Left, Event::Right, Event::Pause, Event::Quit }));
+
+	// The graph's tables include the members of each set
+	LeanHsm::StateGraph<Event> graph(ConsoleTest::Console);
+	auto playing = graph.IndexOf(ConsoleTest::Playing);
+	auto paused = graph.IndexOf(ConsoleTest::Paused);
+	REQUIRE_TRUE(graph.AcceptMask(paused).all());
+	REQUIRE_TRUE(graph.AcceptMask(playing) == sm.EnabledEvents());
+	REQUIRE_TRUE(graph.NextState(playing, Event::Down) == playing);
+	REQUIRE_TRUE(graph.NextState(playing, Event::Quit) == graph.IndexOf(ConsoleTest::Off));
+	REQUIRE_TRUE(graph.NextState(paused, Event::Quit) == paused);
+	REQUIRE_TRUE(graph.NextState(paused, Event::Pause) == playing);
+
+	// The wildcard only adds events that exist
+	REQUIRE_TRUE(graph.Events().size() == 6);
+	return true;
+}
+
+namespace BuildingTest
+{
+	// A building whose doors share one lock submachine
+	enum class Event { Lock, Unlock, Switch };
+	using Hsm = LeanHsm::StateMachine<Event>;
+	using Name = Hsm::Name;
+	using StartIn = Hsm::StartIn;
+	using When = Hsm::When;
+
+	int lockCount = 0;
+	int leaveCount = 0;
+	void CountLock(Hsm&) { ++lockCount; }
+	void CountLeave(Hsm&) { ++leaveCount; }
+
+	extern const Hsm::State Building;
+	extern const Hsm::State FrontDoor;
+	extern const Hsm::State BackDoor;
+	extern const Hsm::State Closed;
+	extern const Hsm::State Unlocked;
+	extern const Hsm::State Locked;
+
+	const Hsm::State Building
+	{
+		Name("Building")
+		.Initially(StartIn(FrontDoor))
+	};
+
+	const Hsm::State FrontDoor
+	{
+		Name("FrontDoor").Parent(Building)
+		.Submachine(Closed)
+		.Always(When(Event::Switch).Goto(BackDoor))
+	};
+
+	const Hsm::State BackDoor
+	{
+		Name("BackDoor").Parent(Building)
+		.Submachine(Closed)
+		.Always(When(Event::Switch).Goto(FrontDoor))
+	};
+
+	// the shared submachine
+	const Hsm::State Closed
+	{
+		Name("Closed")
+		.OnExit(CountLeave)
+		.Initially(StartIn(Unlocked))
+	};
+
+	const Hsm::State Unlocked
+	{
+		Name("Unlocked").Parent(Closed)
+		.Always(When(Event::Lock).Goto(Locked).Do(CountLock))
+	};
+
+	const Hsm::State Locked
+	{
+		Name("Locked").Parent(Closed)
+		.Always(When(Event::Unlock).Goto(Unlocked))
+	};
+}
+
+bool Test_Submachines()
+{
+	using BuildingTest::Event;
+
+	// Entering a placement enters the submachine
+	BuildingTest::lockCount = 0;
+	BuildingTest::leaveCount = 0;
+	LeanHsm::StateGraph<Event> graph(BuildingTest::Building);
+	TestMachine<BuildingTest::Event> sm(BuildingTest::Building);
+	sm.BindGraph(&graph);
+	REQUIRE_TRUE(sm.IsInState(BuildingTest::Unlocked));
+	REQUIRE_TRUE(sm.IsInState(BuildingTest::FrontDoor));
+	REQUIRE_TRUE(sm.SubmachineDepth() == 1);
+	REQUIRE_TRUE(sm.ParentOf(&BuildingTest::Closed) == &BuildingTest::FrontDoor);
+	REQUIRE_TRUE(sm.HandeleEvent(Event::Lock));
+	REQUIRE_TRUE(sm.IsInState(BuildingTest::Locked));
+	auto frontLocked = sm.SaveConfiguration();
+	auto frontHash = sm.ConfigurationHash();
+
+	// Placements' transitions are inherited, and leaving one exits the submachine
+	REQUIRE_TRUE(sm.CanHandle(Event::Switch));
+	REQUIRE_TRUE(sm.EnabledEvents().test(LeanHsm::EventIndex(Event::Switch)));
+	REQUIRE_TRUE(sm.EnabledEventsSnapshot().all());
+	REQUIRE_TRUE(sm.HandeleEvent(Event::Switch));
+	REQUIRE_TRUE(BuildingTest::leaveCount == 1);
+	REQUIRE_TRUE(sm.IsInState(BuildingTest::BackDoor));
+	REQUIRE_FALSE(sm.IsInState(BuildingTest::FrontDoor));
+	REQUIRE_TRUE(sm.IsInState(BuildingTest::Unlocked));
+	REQUIRE_TRUE(sm.SubmachineDepth() == 1);
+	REQUIRE_TRUE(sm.HandeleEvent(Event::Lock));
+	REQUIRE_TRUE(BuildingTest::lockCount == 2);
+
+	// The same submachine state in different placements has different hashes
+	REQUIRE_TRUE(sm.CurrentState().name == BuildingTest::Locked.name);
+	REQUIRE_TRUE(sm.ConfigurationHash() != frontHash);
+
+	// Configurations keep the placements
+	sm.RestoreConfiguration(frontLocked);
+	REQUIRE_TRUE(sm.IsInState(BuildingTest::FrontDoor));
+	REQUIRE_TRUE(sm.ConfigurationHash() == frontHash);
+	auto fork = sm.Fork();
+	REQUIRE_TRUE(fork.HandeleEvent(Event::Switch));
+	REQUIRE_TRUE(fork.IsInState(BuildingTest::BackDoor));
+	REQUIRE_TRUE(sm.IsInState(BuildingTest::FrontDoor));
+
+	// The graph indexes the submachine once, and its placements enter it
+	REQUIRE_TRUE(graph.StateCount() == 6);
+	auto unlocked = graph.IndexOf(BuildingTest::Unlocked);
+	REQUIRE_TRUE(graph.NextState(graph.IndexOf(BuildingTest::FrontDoor), Event::Switch) == unlocked);
+	REQUIRE_TRUE(graph.NextState(unlocked, Event::Lock) == graph.IndexOf(BuildingTest::Locked));
+	REQUIRE_FALSE(graph.AcceptMask(unlocked).test(LeanHsm::EventIndex(Event::Switch)));
+
+	// Populations count instances in their placements too
+	TestMachine<BuildingTest::Event> front(BuildingTest::Building);
+	TestMachine<BuildingTest::Event> back(BuildingTest::Building);
+	LeanHsm::Population<Event> population(graph);
+	population.Add(front);
+	population.Add(back);
+	REQUIRE_TRUE(back.HandeleEvent(Event::Switch));
+	REQUIRE_TRUE(population.CountIn(BuildingTest::Building) == 2);
+	REQUIRE_TRUE(population.CountIn(BuildingTest::FrontDoor) == 1);
+	REQUIRE_TRUE(population.CountIn(BuildingTest::BackDoor) == 1);
+	REQUIRE_TRUE(population.CountIn(BuildingTest::Unlocked) == 2);
+	std::vector<uint32_t> visited;
+	population.ForEachIn(BuildingTest::BackDoor, [&](uint32_t id) { visited.push_back(id); });
+	REQUIRE_TRUE(visited == std::vector<uint32_t>{ 1 });
+	visited.clear();
+	population.ForEachIn(BuildingTest::Building, [&](uint32_t id) { visited.push_back(id); });
+	REQUIRE_TRUE(visited.size() == 2);
+
+	// Moving between placements, in the same submachine state, updates the indexes
+	auto checksum = population.Checksum();
+	std::vector<LeanHsm::Population<Event>::Configuration> frame;
+	population.SaveStates(frame);
+	REQUIRE_TRUE(front.HandeleEvent(Event::Switch));
+	REQUIRE_TRUE(population.CountIn(BuildingTest::FrontDoor) == 0);
+	REQUIRE_TRUE(population.CountIn(BuildingTest::BackDoor) == 2);
+	REQUIRE_TRUE(population.Checksum() != checksum);
+	std::vector<LeanHsm::CommandBuffer<int>> buffers(1); // the exit action counts in a global
+	REQUIRE_TRUE(population.DispatchParallel(Event::Switch, buffers) == 2);
+	REQUIRE_TRUE(population.CountIn(BuildingTest::FrontDoor) == 2);
+	REQUIRE_TRUE(population.RewindStates(frame) == 1);
+	REQUIRE_TRUE(back.IsInState(BuildingTest::BackDoor));
+	REQUIRE_TRUE(population.CountIn(BuildingTest::FrontDoor) == 1);
+	REQUIRE_TRUE(population.Checksum() == checksum);
+
+	// State indices don't hold placements, so journals refuse them
+	LeanHsm::TransitionJournal journal;
+	LeanHsm::RecoveredStates recovered{ 0, { unlocked, unlocked } };
+	REQUIRE_FALSE(LeanHsm::JournalTransitions(journal, population));
+	REQUIRE_FALSE(LeanHsm::RestoreStates(population, recovered));
+	REQUIRE_TRUE(back.IsInState(BuildingTest::BackDoor));
+
+	// Nor do shared state pools, while change logs record moves between placements
+	LeanHsm::SharedStatePool<Event> pool(graph);
+	REQUIRE_TRUE(pool.Create("LeanHsmTest_Building", 2));
+	REQUIRE_FALSE(pool.Attach(0, front));
+	LeanHsm::ChangeLog<Event> changes(8);
+	changes.Subscribe(front);
+	REQUIRE_TRUE(front.IsInState(BuildingTest::FrontDoor));
+	REQUIRE_TRUE(front.HandeleEvent(Event::Switch));
+	std::vector<const BuildingTest::Hsm::State*> changedTo;
+	REQUIRE_TRUE(changes.Drain([&](const LeanHsm::ChangeLog<Event>::Change& c) { changedTo.push_back(c.to); }) == 1);
+	REQUIRE_TRUE(changedTo.front() == &BuildingTest::Unlocked);
+	return true;
+}
+
+namespace SwitchTest
+{
+	// A switch whose events are strings, so it has no event tables
+	using Hsm = LeanHsm::StateMachine<std::string>;
+	using Name = Hsm::Name;
+	using StartIn = Hsm::StartIn;
+	using When = Hsm::When;
+
+	extern const Hsm::State Switch;
+	extern const Hsm::State Off;
+	extern const Hsm::State On;
+
+	const Hsm::State Switch
+	{
+		Name("Switch")
+		.Initially(StartIn(Off))
+	};
+
+	const Hsm::State Off
+	{
+		Name("Off").Parent(Switch)
+		.Always(When("on").Goto(On))
+		.Defer("dim")
+	};
+
+	const Hsm::State On
+	{
+		Name("On").Parent(Switch)
+		.Always(When("off").Goto(Off))
+		.Always(When("dim"))
+	};
+}
+
+bool Test_StringEvents()
+{
+	TestMachine<std::string> sm(SwitchTest::Switch);
+	sm.Initialize();
+	REQUIRE_TRUE(sm.IsInState(SwitchTest::Off));
+	REQUIRE_TRUE(sm.CanHandle("on"));
+	REQUIRE_FALSE(sm.CanHandle("off"));
+	REQUIRE_TRUE(sm.EnabledEvents().none());
+
+	// Exact transitions and deferrals work without event indices
+	REQUIRE_TRUE(sm.HandeleEvent("dim"));
+	REQUIRE_TRUE(sm.DeferredCount() == 1);
+	REQUIRE_TRUE(sm.HandeleEvent("on"));
+	REQUIRE_TRUE(sm.IsInState(SwitchTest::On));
+	REQUIRE_TRUE(sm.DeferredCount() == 0);
+	REQUIRE_FALSE(sm.HandeleEvent("on"));
+	REQUIRE_TRUE(sm.HandeleEvent("off"));
+	REQUIRE_TRUE(sm.IsInState(SwitchTest::Off));
+
+	// Graphs have edges for exact transitions
+	LeanHsm::StateGraph<std::string> graph(SwitchTest::Switch);
+	auto off = graph.IndexOf(SwitchTest::Off);
+	REQUIRE_TRUE(graph.Events().size() == 3);
+	REQUIRE_TRUE(graph.NextState(off, "on") == graph.IndexOf(SwitchTest::On));
+	REQUIRE_TRUE(graph.CanReach(graph.IndexOf(SwitchTest::On), off));
+	return true;
+}
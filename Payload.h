@@ -0,0 +1,189 @@
+// Copyright 2016, Jason Conaway
+// Payload is data that travels with an event, such as the damage amount of
+// a Hit event. Payloads are constructed in blocks of a shared PayloadSlab,
+// and ownership of the block is handed from sender to receiver without
+// copying the data. The block returns to the slab when the payload is
+// released, which happens after the receiver has handled the event.
+//
+// USAGE:
+// LeanHsm::PayloadSlab slab(64, 1024);      // 1024 blocks of 64 bytes
+// auto payload = slab.Make<Hit>(10, attacker);
+// target.Post(Event::Hit, std::move(payload));
+// ...
+// // in an action of the target's state machine:
+// if (auto hit = hsm.EventPayload<Hit>()) { ... }
+#pragma once
+
+#include "TypeTag.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+
+namespace LeanHsm
+{
+
+class PayloadSlab;
+
+// Payload owns an object in a PayloadSlab block. It can be moved, not copied.
+class Payload
+{
+public:
+	Payload() = default;
+	Payload(Payload&& other) { *this = std::move(other); }
+	Payload& operator=(Payload&& other)
+	{
+		if (this != &other)
+		{
+			Reset();
+			std::swap(mData, other.mData);
+			std::swap(mType, other.mType);
+			std::swap(mDestroy, other.mDestroy);
+			std::swap(mSlab, other.mSlab);
+		}
+		return *this;
+	}
+	~Payload() { Reset(); }
+
+	Payload(const Payload&) = delete;
+	Payload& operator=(const Payload&) = delete;
+
+	// Destroys the object, and returns its block to the slab.
+	void Reset();
+
+	// Returns the object if it is a T, or null otherwise.
+	template<typename T>
+	const T* Get() const { return mType == TypeTag<T>() ? static_cast<const T*>(mData) : nullptr; }
+
+	const void* Data() const { return mData; }
+	const void* Type() const { return mType; }
+	explicit operator bool() const { return mData != nullptr; }
+
+private:
+	friend class PayloadSlab;
+	void* mData{ nullptr };
+	const void* mType{ nullptr };
+	void (*mDestroy)(void* data){ nullptr };
+	PayloadSlab* mSlab{ nullptr };
+};
+
+// PayloadSlab is a fixed pool of equally sized blocks, with a lock-free free
+// list, so any thread may make and release payloads without allocating.
+class PayloadSlab
+{
+public:
+	PayloadSlab(size_t blockSize, size_t blockCount);
+
+	PayloadSlab(const PayloadSlab&) = delete;
+	PayloadSlab& operator=(const PayloadSlab&) = delete;
+
+	// Constructs a T in a free block. Returns an empty payload if the slab
+	// is exhausted, or if a T does not fit in a block.
+	template<typename T, typename... Args>
+	Payload Make(Args&&... args);
+
+	size_t BlockSize() const { return mBlockSize; }
+
+private:
+	friend class Payload;
+	void* Allocate();
+	void Free(void* block);
+
+	enum : uint32_t { EndOfList = ~0u };
+
+	size_t mBlockSize;
+	std::unique_ptr<std::max_align_t[]> mStorage;
+	std::unique_ptr<std::atomic<uint32_t>[]> mNext;
+	std::atomic<uint64_t> mHead; // tag in the high half avoids ABA problems
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Payload implementation
+
+inline void Payload::Reset()
+{
+	if (mData)
+	{
+		mDestroy(mData);
+		mSlab->Free(mData);
+		mData = nullptr;
+		mType = nullptr;
+		mDestroy = nullptr;
+		mSlab = nullptr;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// PayloadSlab implementation
+
+inline PayloadSlab::PayloadSlab(size_t blockSize, size_t blockCount)
+{
+	// round blocks up to a multiple of the maximum alignment
+	const size_t align = sizeof(std::max_align_t);
+	mBlockSize = (std::max<size_t>(blockSize, 1) + align - 1) / align * align;
+	mStorage.reset(new std::max_align_t[mBlockSize / align * blockCount]);
+	mNext.reset(new std::atomic<uint32_t>[blockCount]);
+	for (size_t i = 0; i < blockCount; ++i)
+	{
+		mNext[i].store(i + 1 < blockCount ? uint32_t(i + 1) : EndOfList, std::memory_order_relaxed);
+	}
+	mHead.store(blockCount > 0 ? 0u : uint32_t(EndOfList), std::memory_order_release);
+}
+
+template<typename T, typename... Args>
+Payload PayloadSlab::Make(Args&&... args)
+{
+	Payload payload;
+	if (sizeof(T) > mBlockSize || alignof(T) > alignof(std::max_align_t))
+	{
+		return payload;
+	}
+	void* block = Allocate();
+	if (block)
+	{
+		payload.mData = new (block) T{ std::forward<Args>(args)... };
+		payload.mType = TypeTag<T>();
+		payload.mDestroy = [](void* data) { static_cast<T*>(data)->~T(); };
+		payload.mSlab = this;
+	}
+	return payload;
+}
+
+inline void* PayloadSlab::Allocate()
+{
+	uint64_t head = mHead.load(std::memory_order_acquire);
+	for (;;)
+	{
+		auto index = uint32_t(head);
+		if (index == EndOfList)
+		{
+			return nullptr;
+		}
+		uint64_t next = ((head >> 32) + 1) << 32 | mNext[index].load(std::memory_order_relaxed);
+		if (mHead.compare_exchange_weak(head, next, std::memory_order_acq_rel, std::memory_order_acquire))
+		{
+			return reinterpret_cast<char*>(mStorage.get()) + index * mBlockSize;
+		}
+	}
+}
+
+inline void PayloadSlab::Free(void* block)
+{
+	auto index = uint32_t((static_cast<char*>(block) - reinterpret_cast<char*>(mStorage.get())) / mBlockSize);
+	uint64_t head = mHead.load(std::memory_order_relaxed);
+	for (;;)
+	{
+		mNext[index].store(uint32_t(head), std::memory_order_relaxed);
+		uint64_t next = ((head >> 32) + 1) << 32 | index;
+		if (mHead.compare_exchange_weak(head, next, std::memory_order_release, std::memory_order_relaxed))
+		{
+			return;
+		}
+	}
+}
+
+} // namespace LeanHsm
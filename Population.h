@@ -0,0 +1,552 @@
+// Copyright 2016, Jason Conaway
+// Population tracks many state machines that share a state graph, and
+// maintains per-state indexes as their transitions are committed. This
+// answers questions like "how many doors are Locked?" or "which doors are
+// Closed (including substates)?" without visiting every machine.
+//
+// USAGE:
+// LeanHsm::StateGraph<Door::Event> graph(Door::Exists);
+// LeanHsm::Population<Door::Event> doors(graph);
+// doors.Add(door.GetStateMachine());
+// ...
+// size_t lockedCount = doors.CountIn(Door::Locked);
+// doors.ForEachIn(Door::Closed, [&](InstanceId id) { ... });
+//
+// Instances inside a submachine (see StateMachine.h) are in the submachine's
+// states, whatever their placement, and also in their placements and the
+// placements' ancestors. So if doors share a lock submachine, CountIn(Locked)
+// counts the doors that are locked in any placement, and CountIn(FrontDoor)
+// counts every door that is placed there, whatever its state inside.
+//
+// The indexes are updated by commit hooks, on the dispatching thread, so the
+// machines of a population must not be dispatched concurrently with each other
+// or with queries, except by DispatchParallel and ForEachParallel. The graph
+// must outlive the added machines, and the machines must outlive the
+// population, which removes its hooks when it is destroyed.
+#pragma once
+
+#include "CommandBuffer.h"
+#include "StateGraph.h"
+#include "StateMachine.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+namespace LeanHsm
+{
+
+template<typename EventType>
+class Population
+{
+public:
+	using Hsm = StateMachine<EventType>;
+	using State = typename Hsm::State;
+	using Configuration = typename Hsm::Configuration;
+	using Graph = StateGraph<EventType>;
+	using InstanceId = uint32_t;
+
+	static const InstanceId InvalidInstance = ~0u;
+
+	explicit Population(const Graph& graph)
+		: mGraph(graph), mCounts(graph.StateCount(), 0), mHeads(graph.StateCount(), InvalidInstance) {}
+
+	~Population()
+	{
+		for (InstanceId id = 0; id < mInstances.size(); ++id)
+		{
+			mInstances[id]->RemoveCommitHook(mHooks[id]);
+		}
+	}
+
+	Population(const Population&) = delete;
+	Population& operator=(const Population&) = delete;
+
+	// Adds a machine to the population, and returns its instance id.
+	// Returns InvalidInstance if the machine's state is not in the graph.
+	InstanceId Add(Hsm& sm);
+
+	size_t Size() const { return mInstances.size(); }
+	const Graph& GetGraph() const { return mGraph; }
+	Hsm& Instance(InstanceId id) const { return *mInstances[id]; }
+
+	// Returns the graph index of the instance's current state
+	uint32_t StateIndexOf(InstanceId id) const { return mStateIndices[id]; }
+
+	// Saves the configuration of every instance (see
+	// StateMachine::SaveConfiguration), for rewinding them later.
+	void SaveStates(std::vector<Configuration>& states) const;
+
+	// Rewinds the instances to saved configurations. Only the instances whose
+	// configurations differ, in state, deferred events or placements, are
+	// restored (see StateMachine::RestoreConfiguration), so no actions are
+	// invoked. Returns the number of instances that were restored.
+	size_t RewindStates(const std::vector<Configuration>& states);
+
+	// Returns the number of events that Dispatch, DispatchAll and
+	// DispatchParallel discarded, because the instance's state didn't handle them.
+	size_t FilteredCount() const { return mFilteredCount; }
+
+	// Returns the number of instances in the state, including its substates
+	// and the submachines placed in them.
+	size_t CountIn(const State& s) const
+	{
+		auto i = mGraph.IndexOf(s);
+		return i != Graph::InvalidIndex ? mCounts[i] : 0;
+	}
+
+	// Returns a checksum of every instance's configuration (see
+	// StateMachine::ConfigurationHash) and instance id. It is updated as
+	// instances change state, so reading it is O(1). Populations whose
+	// instances are in the same states have the same checksum.
+	uint64_t Checksum() const { return mChecksum; }
+
+	// Invokes visitor(InstanceId) for each instance in the state, including
+	// its substates and the submachines placed in them. Only states in the
+	// subtree are visited, so the cost is proportional to the size of the
+	// result, not the size of the population, plus the instances that are in
+	// the subtree's submachines in other placements.
+	template<typename Visitor>
+	void ForEachIn(const State& s, Visitor&& visitor) const;
+
+	// Dispatches an event to the specified instances, or to every instance.
+	// Instances are grouped by their current state, and the transition is
+	// found once per group. Groups whose state doesn't handle (or defer) the
+	// event are skipped, and counted as filtered, without logging a warning
+	// for each. Each group is then dispatched back to back, which keeps the
+	// same actions hot while many instances run them.
+	// Returns the number of instances that handled the event.
+	size_t Dispatch(const EventType& e, const std::vector<InstanceId>& ids);
+	size_t DispatchAll(const EventType& e);
+
+	// Dispatches an event to every instance in parallel, with one thread per
+	// command buffer. Each thread handles a contiguous range of instances, with
+	// its command buffer bound to them, so that actions can Emit commands instead
+	// of touching shared systems. Log entries are buffered the same way, and
+	// logged in order of instance id after all threads are done, so the output
+	// doesn't interleave. The indexes are also updated after all threads are
+	// done. Apply the buffers afterwards with CommandBuffer::ApplyInOrder.
+	// Returns the number of instances that handled the event.
+	template<typename CommandType>
+	size_t DispatchParallel(const EventType& e, std::vector<CommandBuffer<CommandType>>& buffers);
+
+	// Invokes visitor(thread, InstanceId) for every instance, on threadCount
+	// threads that each visit a contiguous range of instances. The visitor may
+	// dispatch events to the instance it is visiting, but to no other. Like
+	// DispatchParallel, the indexes are updated after all threads are done.
+	template<typename Visitor>
+	void ForEachParallel(size_t threadCount, Visitor&& visitor);
+
+private:
+	size_t DispatchSorted(const EventType& e);
+	void Link(InstanceId id, uint32_t stateIndex);
+	void Unlink(InstanceId id, uint32_t stateIndex);
+	void SavePlacements(InstanceId id);
+	bool IsIn(InstanceId id, uint32_t ancestor) const;
+	template<typename Visitor>
+	void ForEachAncestor(InstanceId id, uint32_t stateIndex, Visitor&& visitor) const;
+	void OnCommit(InstanceId id, const State& to);
+	void Move(InstanceId id, uint32_t stateIndex);
+	static uint64_t InstanceHash(InstanceId id, uint64_t configurationHash);
+
+	const Graph& mGraph;
+	std::vector<Hsm*> mInstances;
+	std::vector<uint32_t> mStateIndices; // per instance
+	std::vector<size_t> mCounts;         // per state, includes substates
+	std::vector<InstanceId> mHeads;      // per state, first instance in the state
+	std::vector<InstanceId> mNext;       // per instance, next in the same state
+	std::vector<InstanceId> mPrev;       // per instance, previous in the same state
+	std::vector<uint32_t> mPlacements;   // per instance, MaxSubmachineDepth state indices, outermost first
+	std::vector<uint32_t> mDepths;       // per instance, the number of placements
+	std::vector<uint64_t> mHashes;       // per instance, the hash in the checksum
+	std::vector<typename Hsm::CommitHookId> mHooks; // per instance
+	uint64_t mChecksum{ 0 };
+	size_t mFilteredCount{ 0 };
+
+	// scratch space for Dispatch, kept to avoid allocating on every call
+	std::vector<InstanceId> mSorted;
+	std::vector<uint32_t> mBucketEnds;
+
+	// while dispatching in parallel, commits only record the new state index,
+	// and the indexes are updated afterwards
+	bool mDeferIndexing{ false };
+	std::vector<uint32_t> mPendingIndices; // per instance
+	std::vector<std::vector<InstanceId>> mMoved; // per thread
+	std::vector<CommandBuffer<typename Hsm::LogLine>> mLogBuffers; // per thread
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Population implementation
+
+template<typename EventType>
+const typename Population<EventType>::InstanceId Population<EventType>::InvalidInstance;
+
+template<typename EventType>
+typename Population<EventType>::InstanceId Population<EventType>::Add(Hsm& sm)
+{
+	auto stateIndex = mGraph.IndexOf(sm.CurrentState());
+	if (stateIndex == Graph::InvalidIndex)
+	{
+		return InvalidInstance;
+	}
+
+	auto id = InstanceId(mInstances.size());
+	mInstances.push_back(&sm);
+	mStateIndices.push_back(stateIndex);
+	mPendingIndices.push_back(stateIndex);
+	mNext.push_back(InvalidInstance);
+	mPrev.push_back(InvalidInstance);
+	mPlacements.resize(mPlacements.size() + MaxSubmachineDepth, Graph::InvalidIndex);
+	mDepths.push_back(0);
+	mHashes.push_back(sm.ConfigurationHash());
+	mChecksum ^= InstanceHash(id, mHashes[id]);
+	SavePlacements(id);
+	Link(id, stateIndex);
+
+	sm.BindGraph(&mGraph);
+	mHooks.push_back(sm.AddCommitHook([this, id](Hsm& sm, const typename Hsm::Commit& c) {
+		// a transition between placements may keep the state, but not the hash
+		if (c.from != c.to || sm.ConfigurationHash() != mHashes[id])
+		{
+			OnCommit(id, *c.to);
+		}
+	}));
+	return id;
+}
+
+template<typename EventType>
+void Population<EventType>::SaveStates(std::vector<Configuration>& states) const
+{
+	states.resize(mInstances.size());
+	for (InstanceId id = 0; id < mInstances.size(); ++id)
+	{
+		states[id] = mInstances[id]->SaveConfiguration();
+	}
+}
+
+template<typename EventType>
+size_t Population<EventType>::RewindStates(const std::vector<Configuration>& states)
+{
+	size_t restoredCount = 0;
+	auto count = std::min(states.size(), mInstances.size());
+	for (InstanceId id = 0; id < count; ++id)
+	{
+		if (states[id] != mInstances[id]->SaveConfiguration())
+		{
+			mInstances[id]->RestoreConfiguration(states[id]);
+			++restoredCount;
+		}
+	}
+	return restoredCount;
+}
+
+template<typename EventType>
+template<typename Visitor>
+void Population<EventType>::ForEachIn(const State& s, Visitor&& visitor) const
+{
+	auto ancestor = mGraph.IndexOf(s);
+	if (ancestor == Graph::InvalidIndex)
+	{
+		return;
+	}
+
+	// instances inside submachines are found through the placements in the
+	// subtree, and checked, since each submachine may be placed elsewhere too
+	std::vector<uint32_t> submachines;
+	for (size_t r = 0; r <= submachines.size(); ++r)
+	{
+		auto root = r == 0 ? ancestor : submachines[r - 1];
+		for (auto i = root; i < mGraph.SubtreeEnd(root); ++i)
+		{
+			if (r > 0 && mGraph.IsInState(i, ancestor))
+			{
+				continue; // a submachine placed inside itself; already visited
+			}
+			for (auto id = mHeads[i]; id != InvalidInstance; id = mNext[id])
+			{
+				if (r == 0 || IsIn(id, ancestor))
+				{
+					visitor(id);
+				}
+			}
+			if (auto submachine = mGraph.StateAt(i).submachine)
+			{
+				auto index = mGraph.IndexOf(*submachine);
+				if (std::find(submachines.begin(), submachines.end(), index) == submachines.end())
+				{
+					submachines.push_back(index);
+				}
+			}
+		}
+	}
+}
+
+template<typename EventType>
+size_t Population<EventType>::Dispatch(const EventType& e, const std::vector<InstanceId>& ids)
+{
+	// bucket the instances by state index (counting sort); instances
+	// in states outside of the graph go into a final bucket
+	auto stateCount = mGraph.StateCount();
+	auto bucketOf = [&](InstanceId id) { return std::min(mStateIndices[id], stateCount); };
+	mBucketEnds.assign(stateCount + 2, 0);
+	for (auto id : ids)
+	{
+		++mBucketEnds[bucketOf(id) + 1];
+	}
+	for (size_t i = 1; i < mBucketEnds.size(); ++i)
+	{
+		mBucketEnds[i] += mBucketEnds[i - 1];
+	}
+	mSorted.resize(ids.size());
+	for (auto id : ids)
+	{
+		mSorted[mBucketEnds[bucketOf(id)]++] = id;
+	}
+	return DispatchSorted(e);
+}
+
+template<typename EventType>
+size_t Population<EventType>::DispatchAll(const EventType& e)
+{
+	// the membership lists are already grouped by state
+	mSorted.clear();
+	for (uint32_t i = 0; i < mGraph.StateCount(); ++i)
+	{
+		for (auto id = mHeads[i]; id != InvalidInstance; id = mNext[id])
+		{
+			mSorted.push_back(id);
+		}
+	}
+	return DispatchSorted(e);
+}
+
+template<typename EventType>
+size_t Population<EventType>::DispatchSorted(const EventType& e)
+{
+	size_t handledCount = 0;
+	uint32_t groupState = Graph::InvalidIndex;
+	const typename Hsm::Transition* transition{ nullptr };
+	for (auto id : mSorted)
+	{
+		// an earlier action may have changed this instance's state, so
+		// compare its current state rather than its bucket
+		auto stateIndex = mStateIndices[id];
+		if (stateIndex == Graph::InvalidIndex || mInstances[id]->SubmachineDepth() > 0)
+		{
+			// a submachine's transitions depend on the instance's placements
+			groupState = Graph::InvalidIndex;
+			transition = mInstances[id]->FindTransition(e);
+		}
+		else if (stateIndex != groupState)
+		{
+			groupState = stateIndex;
+			transition = Hsm::FindTransition(mGraph.StateAt(stateIndex), e);
+		}
+		if (!transition && !mInstances[id]->Defers(e))
+		{
+			++mFilteredCount;
+		}
+		else if (mInstances[id]->HandleResolvedEvent(e, transition))
+		{
+			++handledCount;
+		}
+	}
+	return handledCount;
+}
+
+template<typename EventType>
+template<typename CommandType>
+size_t Population<EventType>::DispatchParallel(const EventType& e, std::vector<CommandBuffer<CommandType>>& buffers)
+{
+	if (buffers.empty())
+	{
+		buffers.resize(1);
+	}
+	std::vector<size_t> handledCounts(buffers.size(), 0);
+	std::vector<size_t> filteredCounts(buffers.size(), 0);
+	mLogBuffers.resize(buffers.size());
+	ForEachParallel(buffers.size(), [&](size_t t, InstanceId id) {
+		auto& sm = *mInstances[id];
+		if (!sm.CanHandle(e))
+		{
+			++filteredCounts[t];
+			return;
+		}
+		sm.BindCommands(&buffers[t], id);
+		sm.BindLogBuffer(&mLogBuffers[t], id);
+		if (sm.HandeleEvent(e))
+		{
+			++handledCounts[t];
+		}
+		sm.template BindCommands<CommandType>(nullptr, 0);
+		sm.BindLogBuffer(nullptr, 0);
+	});
+	CommandBuffer<typename Hsm::LogLine>::ApplyInOrder(mLogBuffers,
+		[](const typename Hsm::LogLine& line) { Hsm::WriteLog(line); });
+
+	size_t handledCount = 0;
+	for (size_t t = 0; t < buffers.size(); ++t)
+	{
+		handledCount += handledCounts[t];
+		mFilteredCount += filteredCounts[t];
+	}
+	return handledCount;
+}
+
+template<typename EventType>
+template<typename Visitor>
+void Population<EventType>::ForEachParallel(size_t threadCount, Visitor&& visitor)
+{
+	threadCount = std::max<size_t>(threadCount, 1);
+	mMoved.resize(threadCount);
+
+	auto visitRange = [&](size_t t) {
+		auto begin = InstanceId(Size() * t / threadCount);
+		auto end = InstanceId(Size() * (t + 1) / threadCount);
+		for (auto id = begin; id < end; ++id)
+		{
+			visitor(t, id);
+			if (mPendingIndices[id] != mStateIndices[id] || mInstances[id]->ConfigurationHash() != mHashes[id])
+			{
+				mMoved[t].push_back(id);
+			}
+		}
+	};
+
+	mDeferIndexing = true;
+	std::vector<std::thread> threads;
+	for (size_t t = 1; t < threadCount; ++t)
+	{
+		threads.emplace_back(visitRange, t);
+	}
+	visitRange(0);
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+	mDeferIndexing = false;
+
+	for (size_t t = 0; t < threadCount; ++t)
+	{
+		for (auto id : mMoved[t])
+		{
+			Move(id, mPendingIndices[id]);
+		}
+		mMoved[t].clear();
+	}
+}
+
+template<typename EventType>
+void Population<EventType>::OnCommit(InstanceId id, const State& to)
+{
+	auto stateIndex = mGraph.IndexOf(to);
+	mPendingIndices[id] = stateIndex;
+	if (!mDeferIndexing)
+	{
+		Move(id, stateIndex);
+	}
+}
+
+template<typename EventType>
+void Population<EventType>::Move(InstanceId id, uint32_t stateIndex)
+{
+	Unlink(id, mStateIndices[id]);
+	mStateIndices[id] = stateIndex;
+	SavePlacements(id);
+	auto hash = mInstances[id]->ConfigurationHash();
+	mChecksum ^= InstanceHash(id, mHashes[id]) ^ InstanceHash(id, hash);
+	mHashes[id] = hash;
+	if (stateIndex != Graph::InvalidIndex)
+	{
+		Link(id, stateIndex);
+	}
+}
+
+template<typename EventType>
+uint64_t Population<EventType>::InstanceHash(InstanceId id, uint64_t configurationHash)
+{
+	// mix in the id, so that instances swapping states changes the checksum
+	uint64_t h = configurationHash ^ (uint64_t(id) * 0x9e3779b97f4a7c15ull);
+	h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+	h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+	return h ^ (h >> 31);
+}
+
+template<typename EventType>
+void Population<EventType>::Link(InstanceId id, uint32_t stateIndex)
+{
+	mPrev[id] = InvalidInstance;
+	mNext[id] = mHeads[stateIndex];
+	if (mHeads[stateIndex] != InvalidInstance)
+	{
+		mPrev[mHeads[stateIndex]] = id;
+	}
+	mHeads[stateIndex] = id;
+
+	ForEachAncestor(id, stateIndex, [this](uint32_t i) { ++mCounts[i]; });
+}
+
+template<typename EventType>
+void Population<EventType>::Unlink(InstanceId id, uint32_t stateIndex)
+{
+	if (stateIndex == Graph::InvalidIndex)
+	{
+		return;
+	}
+	if (mPrev[id] != InvalidInstance)
+	{
+		mNext[mPrev[id]] = mNext[id];
+	}
+	else
+	{
+		mHeads[stateIndex] = mNext[id];
+	}
+	if (mNext[id] != InvalidInstance)
+	{
+		mPrev[mNext[id]] = mPrev[id];
+	}
+
+	ForEachAncestor(id, stateIndex, [this](uint32_t i) { --mCounts[i]; });
+}
+
+template<typename EventType>
+void Population<EventType>::SavePlacements(InstanceId id)
+{
+	auto& sm = *mInstances[id];
+	mDepths[id] = uint32_t(sm.SubmachineDepth());
+	for (size_t d = 0; d < sm.SubmachineDepth(); ++d)
+	{
+		mPlacements[id * MaxSubmachineDepth + d] = mGraph.IndexOf(sm.PlacementAt(d));
+	}
+}
+
+template<typename EventType>
+bool Population<EventType>::IsIn(InstanceId id, uint32_t ancestor) const
+{
+	bool found = false;
+	ForEachAncestor(id, mStateIndices[id], [&](uint32_t i) { found = found || i == ancestor; });
+	return found;
+}
+
+template<typename EventType>
+template<typename Visitor>
+void Population<EventType>::ForEachAncestor(InstanceId id, uint32_t stateIndex, Visitor&& visitor) const
+{
+	// the state and its ancestors, up to the top of its submachine, and then
+	// each placement (innermost first) and its ancestors
+	for (auto i = stateIndex; i != Graph::InvalidIndex; i = mGraph.ParentOf(i))
+	{
+		visitor(i);
+	}
+	for (auto d = mDepths[id]; d > 0; --d)
+	{
+		for (auto i = mPlacements[id * MaxSubmachineDepth + d - 1]; i != Graph::InvalidIndex; i = mGraph.ParentOf(i))
+		{
+			visitor(i);
+		}
+	}
+}
+
+} // namespace LeanHsm
@@ -0,0 +1,140 @@
+// Copyright 2016, Jason Conaway
+// Replay rebuilds a population from a snapshot and a transition journal (see
+// Journal.h) by handling the journaled events again, rather than only setting
+// the final states like RestoreStates does. This also rebuilds whatever the
+// actions keep in their owners, like Door's current effect.
+//
+// The journal is partitioned by instance, and the instances are replayed in
+// parallel (see Population::ForEachParallel). Each instance handles its own
+// events in journal order. Actions are suppressed, or invoked in replay-safe
+// mode, so external side effects are not repeated (see StateMachine::ReplayMode).
+// Replayed transitions are not journaled again.
+//
+// USAGE:
+// LeanHsm::ReplayStats stats;
+// LeanHsm::Replay("doors.snapshot", "doors.journal", doors, 8,
+//     Door::Hsm::ReplayMode::ReplaySafeActions, stats);
+#pragma once
+
+#include "EventMask.h"
+#include "Journal.h"
+#include "Population.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace LeanHsm
+{
+
+struct ReplayStats
+{
+	uint64_t sequence; // the last sequence that was replayed
+	size_t replayed;   // events that were handled again
+	size_t diverged;   // events whose replay didn't match the journal
+};
+
+// Restores the snapshot into the population, and then replays the journal
+// on threadCount threads. If a replayed event doesn't lead from the journaled
+// 'from' state to the journaled 'to' state (for example, because the state
+// definitions changed), the machine is restored to the 'to' state and the
+// event is counted as diverged. Returns false if the snapshot can't be used,
+// or if the graph has submachines (see Journal.h).
+template<typename EventType>
+bool Replay(const std::string& snapshotPath, const std::string& journalPath,
+	Population<EventType>& population, size_t threadCount,
+	typename StateMachine<EventType>::ReplayMode mode, ReplayStats& stats);
+
+///////////////////////////////////////////////////////////////////////////
+// Replay implementation
+
+template<typename EventType>
+bool Replay(const std::string& snapshotPath, const std::string& journalPath,
+	Population<EventType>& population, size_t threadCount,
+	typename StateMachine<EventType>::ReplayMode mode, ReplayStats& stats)
+{
+	using Hsm = StateMachine<EventType>;
+	stats = ReplayStats{ 0, 0, 0 };
+
+	RecoveredStates snapshot;
+	auto& graph = population.GetGraph();
+	if (graph.HasSubmachines() || !ReadSnapshot(snapshotPath, graph.Fingerprint(), snapshot))
+	{
+		return false;
+	}
+	stats.sequence = snapshot.sequence;
+
+	// partition the records by instance (counting sort), keeping each
+	// instance's records in journal order
+	std::vector<JournalRecord> records;
+	ReadJournal(journalPath, snapshot.sequence, [&](const JournalRecord& record) {
+		if (record.instance < population.Size())
+		{
+			records.push_back(record);
+		}
+		stats.sequence = record.sequence;
+	});
+	std::vector<size_t> ends(population.Size() + 1, 0);
+	for (auto& record : records)
+	{
+		++ends[record.instance + 1];
+	}
+	for (size_t i = 1; i < ends.size(); ++i)
+	{
+		ends[i] += ends[i - 1];
+	}
+	std::vector<JournalRecord> partitioned(records.size());
+	for (auto& record : records)
+	{
+		partitioned[ends[record.instance]++] = record;
+	}
+	// ends[id] is now the end of instance id's records, and the start of id + 1's
+
+	threadCount = std::max<size_t>(threadCount, 1);
+	std::vector<size_t> divergedCounts(threadCount, 0);
+	population.ForEachParallel(threadCount, [&](size_t t, uint32_t id) {
+		auto& sm = population.Instance(id);
+		sm.SetReplayMode(mode);
+		if (id < snapshot.states.size() && snapshot.states[id] < graph.StateCount())
+		{
+			sm.Restore(graph.StateAt(snapshot.states[id]));
+		}
+		for (auto i = id > 0 ? ends[id - 1] : 0; i < ends[id]; ++i)
+		{
+			auto& record = partitioned[i];
+			if (record.from >= graph.StateCount() || record.to >= graph.StateCount())
+			{
+				++divergedCounts[t];
+				continue;
+			}
+			bool diverged = false;
+			if (graph.IndexOf(sm.CurrentState()) != record.from)
+			{
+				sm.Restore(graph.StateAt(record.from));
+				diverged = true;
+			}
+			sm.HandeleEvent(EventFromIndex<EventType>(record.event));
+			if (graph.IndexOf(sm.CurrentState()) != record.to)
+			{
+				sm.Restore(graph.StateAt(record.to));
+				diverged = true;
+			}
+			if (diverged)
+			{
+				++divergedCounts[t];
+			}
+		}
+		sm.SetReplayMode(Hsm::ReplayMode::Off);
+	});
+
+	stats.replayed = records.size();
+	for (auto count : divergedCounts)
+	{
+		stats.diverged += count;
+	}
+	return true;
+}
+
+} // namespace LeanHsm
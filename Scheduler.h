@@ -0,0 +1,328 @@
+// Copyright 2016, Jason Conaway
+// Scheduler runs many active objects (e.g. ActiveMachines) on a fixed pool
+// of worker threads. An active object with pending events is put on a ready
+// queue, and a worker runs it for up to one batch of events before moving on
+// to the next ready object. Each active object is run by at most one worker
+// at a time, so its state machine still runs to completion. Idle workers
+// steal ready objects from busy workers.
+//
+// Objects that receive events in a signal handler (see
+// ActiveMachine::PostFromSignal) can't take the scheduler's locks, so they
+// only raise atomic flags, which the workers poll between batches, and at
+// least every SignalPollInterval while idle.
+//
+// USAGE:
+// LeanHsm::Scheduler scheduler(4, 16);            // 4 threads, 16 events per batch
+// LeanHsm::ActiveMachine<Door::Event> active(door.GetStateMachine(), 64);
+// scheduler.Attach(active);
+// active.Post(Door::Event::Lock);                // from any thread
+// scheduler.WaitIdle();
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if ATOMIC_BOOL_LOCK_FREE != 2
+#error "Scheduler requires lock-free atomic flags"
+#endif
+
+namespace LeanHsm
+{
+
+class Scheduler;
+
+// How often idle workers check for objects that were notified from signal handlers
+const std::chrono::milliseconds SignalPollInterval{ 10 };
+
+// ActiveObject is something with pending work that a Scheduler can run
+class ActiveObject
+{
+public:
+	ActiveObject() = default;
+	ActiveObject(const ActiveObject&) = delete;
+	ActiveObject& operator=(const ActiveObject&) = delete;
+	virtual ~ActiveObject() = default;
+
+	// Processes up to maxEvents pending events.
+	// Returns true if there are more pending events.
+	virtual bool Run(size_t maxEvents) = 0;
+
+	// Returns true if there are pending events.
+	virtual bool HasPending() const = 0;
+
+	// Returns the number of pending events. This is only a hint while other
+	// threads are adding events.
+	virtual size_t PendingCount() const = 0;
+
+protected:
+	// Tells the scheduler (if any) that this object has pending events.
+	// Derived classes call this after adding an event.
+	void Notify();
+
+	// Same as Notify, but async-signal-safe. The scheduler runs the object
+	// once a worker polls the flags.
+	void NotifyFromSignal();
+
+private:
+	friend class Scheduler;
+	Scheduler* mScheduler{ nullptr };
+	std::atomic<bool> mScheduled{ false }; // true while ready or running
+	std::atomic<bool> mSignalled{ false }; // set by NotifyFromSignal
+};
+
+class Scheduler
+{
+public:
+	Scheduler(size_t threadCount, size_t batchSize);
+	~Scheduler();
+
+	Scheduler(const Scheduler&) = delete;
+	Scheduler& operator=(const Scheduler&) = delete;
+
+	// Runs the object on this scheduler whenever it has pending events.
+	// The object must outlive the scheduler.
+	void Attach(ActiveObject& object);
+
+	// Blocks until no objects are ready or running.
+	void WaitIdle();
+
+	size_t ThreadCount() const { return mWorkers.size(); }
+	size_t BatchSize() const { return mBatchSize; }
+
+private:
+	friend class ActiveObject;
+
+	struct Worker
+	{
+		std::mutex mutex;
+		std::deque<ActiveObject*> ready;
+		std::thread thread;
+	};
+
+	void MakeReady(ActiveObject& object);
+	ActiveObject* TakeReady(size_t worker);
+	void WorkerLoop(size_t worker);
+	void PollSignals();
+	void Release();
+	static size_t& CurrentWorker();
+
+	size_t mBatchSize;
+	std::vector<std::unique_ptr<Worker>> mWorkers;
+	std::atomic<size_t> mReadyCount{ 0 };
+	std::atomic<size_t> mNextWorker{ 0 };
+	std::atomic<bool> mSignalled{ false }; // some object was notified from a signal handler
+	std::vector<ActiveObject*> mAttached;  // guarded by mMutex
+	size_t mScheduledCount{ 0 }; // guarded by mMutex
+	bool mStopping{ false };     // guarded by mMutex
+	std::mutex mMutex;
+	std::condition_variable mWake;
+	std::condition_variable mIdle;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// ActiveObject implementation
+
+inline void ActiveObject::Notify()
+{
+	if (mScheduler && !mScheduled.exchange(true, std::memory_order_acq_rel))
+	{
+		{
+			std::lock_guard<std::mutex> lock(mScheduler->mMutex);
+			++mScheduler->mScheduledCount;
+		}
+		mScheduler->MakeReady(*this);
+	}
+}
+
+inline void ActiveObject::NotifyFromSignal()
+{
+	// the object's flag first, so that a worker that sees the scheduler's flag sees it too
+	mSignalled.store(true, std::memory_order_release);
+	if (mScheduler)
+	{
+		mScheduler->mSignalled.store(true, std::memory_order_release);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Scheduler implementation
+
+inline Scheduler::Scheduler(size_t threadCount, size_t batchSize)
+	: mBatchSize(std::max<size_t>(batchSize, 1))
+{
+	threadCount = std::max<size_t>(threadCount, 1);
+	for (size_t i = 0; i < threadCount; ++i)
+	{
+		mWorkers.emplace_back(new Worker);
+	}
+	for (size_t i = 0; i < threadCount; ++i)
+	{
+		mWorkers[i]->thread = std::thread(&Scheduler::WorkerLoop, this, i);
+	}
+}
+
+inline Scheduler::~Scheduler()
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mStopping = true;
+	}
+	mWake.notify_all();
+	for (auto& worker : mWorkers)
+	{
+		worker->thread.join();
+	}
+}
+
+inline void Scheduler::Attach(ActiveObject& object)
+{
+	object.mScheduler = this;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mAttached.push_back(&object);
+	}
+	if (object.HasPending())
+	{
+		object.Notify();
+	}
+}
+
+inline void Scheduler::WaitIdle()
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	mIdle.wait(lock, [this] { return mScheduledCount == 0; });
+}
+
+inline size_t& Scheduler::CurrentWorker()
+{
+	static thread_local size_t worker{ ~size_t(0) };
+	return worker;
+}
+
+inline void Scheduler::MakeReady(ActiveObject& object)
+{
+	// workers keep their own work local; other threads spread it around
+	auto worker = CurrentWorker();
+	if (worker >= mWorkers.size())
+	{
+		worker = mNextWorker.fetch_add(1, std::memory_order_relaxed) % mWorkers.size();
+	}
+	{
+		std::lock_guard<std::mutex> lock(mWorkers[worker]->mutex);
+		mWorkers[worker]->ready.push_back(&object);
+	}
+	mReadyCount.fetch_add(1, std::memory_order_release);
+	{
+		// synchronize with workers that are about to wait
+		std::lock_guard<std::mutex> lock(mMutex);
+	}
+	mWake.notify_one();
+}
+
+inline ActiveObject* Scheduler::TakeReady(size_t worker)
+{
+	// take the oldest of our own ready objects, or steal the newest of another's
+	for (size_t i = 0; i < mWorkers.size(); ++i)
+	{
+		auto& victim = *mWorkers[(worker + i) % mWorkers.size()];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+		if (!victim.ready.empty())
+		{
+			ActiveObject* object;
+			if (i == 0)
+			{
+				object = victim.ready.front();
+				victim.ready.pop_front();
+			}
+			else
+			{
+				object = victim.ready.back();
+				victim.ready.pop_back();
+			}
+			mReadyCount.fetch_sub(1, std::memory_order_relaxed);
+			return object;
+		}
+	}
+	return nullptr;
+}
+
+inline void Scheduler::WorkerLoop(size_t worker)
+{
+	CurrentWorker() = worker;
+	for (;;)
+	{
+		PollSignals();
+		auto object = TakeReady(worker);
+		if (!object)
+		{
+			std::unique_lock<std::mutex> lock(mMutex);
+			mWake.wait_for(lock, SignalPollInterval, [this] {
+				return mStopping || mReadyCount.load(std::memory_order_acquire) > 0 ||
+					mSignalled.load(std::memory_order_acquire);
+			});
+			if (mStopping)
+			{
+				return;
+			}
+			continue;
+		}
+
+		if (object->Run(mBatchSize))
+		{
+			// still has events; go to the back of the line
+			MakeReady(*object);
+			continue;
+		}
+
+		// give up the scheduled flag, then catch events posted meanwhile
+		object->mScheduled.store(false, std::memory_order_release);
+		if (object->HasPending() && !object->mScheduled.exchange(true, std::memory_order_acq_rel))
+		{
+			MakeReady(*object);
+			continue;
+		}
+		Release();
+	}
+}
+
+inline void Scheduler::PollSignals()
+{
+	if (!mSignalled.load(std::memory_order_acquire) || !mSignalled.exchange(false, std::memory_order_acq_rel))
+	{
+		return;
+	}
+	std::vector<ActiveObject*> signalled;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		for (auto object : mAttached)
+		{
+			if (object->mSignalled.exchange(false, std::memory_order_acq_rel))
+			{
+				signalled.push_back(object);
+			}
+		}
+	}
+	for (auto object : signalled)
+	{
+		object->Notify();
+	}
+}
+
+inline void Scheduler::Release()
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	if (--mScheduledCount == 0)
+	{
+		mIdle.notify_all();
+	}
+}
+
+} // namespace LeanHsm
@@ -0,0 +1,400 @@
+// Copyright 2016, Jason Conaway
+// SharedEventRing carries events from other processes (e.g. a network
+// front-end) into the process that owns and dispatches the state machines.
+// It is a bounded, lock-free, multi-producer/single-consumer ring of
+// (instance id, event id, payload) records in a shared memory segment.
+// When the ring is empty, the consumer can sleep in Wait, and producers wake
+// it with a futex (Linux) or a named event (Windows).
+//
+// USAGE (consumer, usually the owner of a Population):
+// LeanHsm::SharedEventRing ring;
+// ring.Create("door_events", 4096, 64);
+// for (;;) { ring.Wait(10); LeanHsm::DispatchIngress(ring, doors, 256); }
+//
+// USAGE (producer, in another process):
+// LeanHsm::SharedEventRing ring;
+// ring.Open("door_events");
+// ring.Post(doorId, uint32_t(Door::Event::Open));
+//
+// Actions read a record's payload with EventPayload<LeanHsm::RawPayload>().
+#pragma once
+
+#include "Population.h"
+#include "SharedMemory.h"
+#include "TypeTag.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#elif !defined(_WIN32)
+#include <chrono>
+#include <thread>
+#endif
+
+#if ATOMIC_INT_LOCK_FREE != 2 || ATOMIC_LLONG_LOCK_FREE != 2
+#error "SharedEventRing requires lock-free atomic integers"
+#endif
+
+namespace LeanHsm
+{
+
+// The payload bytes of a record, as seen by actions
+struct RawPayload
+{
+	const void* data;
+	uint32_t size;
+};
+
+// A record as seen by the consumer. The payload is only valid during the
+// consumer's callback.
+struct IngressRecord
+{
+	uint32_t instance;
+	uint32_t event;
+	RawPayload payload;
+};
+
+class SharedEventRing
+{
+public:
+	SharedEventRing() = default;
+	~SharedEventRing() { Close(); }
+
+	SharedEventRing(const SharedEventRing&) = delete;
+	SharedEventRing& operator=(const SharedEventRing&) = delete;
+
+	// Creates the ring, for the consumer. Capacity is rounded up to a power
+	// of two. Returns false if the ring could not be created.
+	bool Create(const std::string& name, uint32_t capacity, uint32_t maxPayloadSize);
+
+	// Opens an existing ring, for producers. Returns false on failure.
+	bool Open(const std::string& name);
+
+	void Close();
+
+	// Appends a record, and wakes the consumer if it is waiting.
+	// Returns false if the ring is full or the payload is too large.
+	bool Post(uint32_t instance, uint32_t event, const void* payload = nullptr, uint32_t payloadSize = 0);
+
+	// Passes up to maxRecords records, oldest first, to consumer(const IngressRecord&).
+	// Only one thread, in one process, may consume. Returns the number consumed.
+	template<typename Consumer>
+	size_t Consume(Consumer&& consumer, size_t maxRecords);
+
+	// Blocks until the ring is not empty, or the timeout elapses.
+	// Returns true if the ring is not empty.
+	bool Wait(uint32_t timeoutMilliseconds);
+
+	bool Empty() const;
+	uint32_t MaxPayloadSize() const { return mHeader ? mHeader->maxPayloadSize : 0; }
+
+	// Counts the consumed records that were rejected (see DispatchIngress).
+	// Only the consumer counts them, so the count is not shared.
+	void CountRejected() { ++mRejected; }
+	size_t RejectedCount() const { return mRejected; }
+
+private:
+	enum : uint32_t { Magic = 0x4C485352u }; // "LHSR"
+	enum : uint32_t { Version = 1 };
+	enum : size_t { CacheLineSize = 64 };
+
+	struct Header
+	{
+		std::atomic<uint32_t> magic; // set last, once the ring is ready
+		uint32_t version;
+		uint32_t capacity;
+		uint32_t cellSize;
+		uint32_t maxPayloadSize;
+		char pad0[CacheLineSize];
+		std::atomic<uint64_t> enqueuePos;
+		char pad1[CacheLineSize];
+		std::atomic<uint64_t> dequeuePos;
+		std::atomic<uint32_t> sleeping;     // the consumer is in Wait
+		std::atomic<uint32_t> wakeSequence; // the futex word
+	};
+
+	struct Cell
+	{
+		std::atomic<uint64_t> sequence;
+		uint32_t instance;
+		uint32_t event;
+		uint32_t payloadSize;
+		uint32_t reserved;
+		// payload bytes follow
+	};
+
+	static size_t CellsOffset() { return (sizeof(Header) + CacheLineSize - 1) / CacheLineSize * CacheLineSize; }
+	Cell& CellAt(uint64_t pos) const
+	{
+		auto cells = static_cast<char*>(mMemory.Data()) + CellsOffset();
+		return *reinterpret_cast<Cell*>(cells + (pos & (mHeader->capacity - 1)) * mHeader->cellSize);
+	}
+	bool Attach(bool created);
+	void Wake();
+
+	SharedMemory mMemory;
+	Header* mHeader{ nullptr };
+	std::string mName;
+	size_t mRejected{ 0 };
+#ifdef _WIN32
+	HANDLE mWakeEvent{ nullptr };
+#endif
+};
+
+// Consumes up to maxRecords records from the ring, and dispatches each one
+// to the population's instance, with the record's payload (if any) as a
+// RawPayload. Records come from other processes, so records for unknown
+// instances, or with events that the population's graph doesn't handle (see
+// StateGraph::Events), are rejected and counted (see RejectedCount).
+// Returns the number of records consumed.
+template<typename EventType>
+size_t DispatchIngress(SharedEventRing& ring, Population<EventType>& population, size_t maxRecords)
+{
+	auto& events = population.GetGraph().Events();
+	return ring.Consume([&](const IngressRecord& record) {
+		auto known = std::find_if(events.begin(), events.end(),
+			[&record](const EventType& e) { return EventIndex(e) == record.event; });
+		if (record.instance >= population.Size() || known == events.end())
+		{
+			ring.CountRejected();
+		}
+		else
+		{
+			auto e = *known;
+			auto& sm = population.Instance(record.instance);
+			if (record.payload.size > 0)
+			{
+				sm.HandleEventWithPayload(e, &record.payload, TypeTag<RawPayload>());
+			}
+			else
+			{
+				sm.HandeleEvent(e);
+			}
+		}
+	}, maxRecords);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// SharedEventRing implementation
+
+inline bool SharedEventRing::Create(const std::string& name, uint32_t capacity, uint32_t maxPayloadSize)
+{
+	Close();
+	uint32_t size = 2;
+	while (size < capacity)
+	{
+		size <<= 1;
+	}
+	auto cellSize = uint32_t((sizeof(Cell) + maxPayloadSize + 7) / 8 * 8);
+	if (!mMemory.Create(name, CellsOffset() + size_t(size) * cellSize))
+	{
+		return false;
+	}
+
+	mHeader = new (mMemory.Data()) Header;
+	mHeader->magic.store(0, std::memory_order_relaxed);
+	mHeader->version = Version;
+	mHeader->capacity = size;
+	mHeader->cellSize = cellSize;
+	mHeader->maxPayloadSize = maxPayloadSize;
+	mHeader->enqueuePos.store(0, std::memory_order_relaxed);
+	mHeader->dequeuePos.store(0, std::memory_order_relaxed);
+	mHeader->sleeping.store(0, std::memory_order_relaxed);
+	mHeader->wakeSequence.store(0, std::memory_order_relaxed);
+	for (uint32_t i = 0; i < size; ++i)
+	{
+		new (&CellAt(i).sequence) std::atomic<uint64_t>(i);
+	}
+	mName = name;
+	if (!Attach(true))
+	{
+		Close();
+		return false;
+	}
+	mHeader->magic.store(Magic, std::memory_order_release);
+	return true;
+}
+
+inline bool SharedEventRing::Open(const std::string& name)
+{
+	Close();
+	if (!mMemory.Open(name, SharedMemory::Access::ReadWrite) || mMemory.Size() < CellsOffset())
+	{
+		return false;
+	}
+	mHeader = static_cast<Header*>(mMemory.Data());
+	mName = name;
+	if (mHeader->magic.load(std::memory_order_acquire) != Magic || mHeader->version != Version ||
+		mMemory.Size() < CellsOffset() + size_t(mHeader->capacity) * mHeader->cellSize ||
+		!Attach(false))
+	{
+		Close();
+		return false;
+	}
+	return true;
+}
+
+inline void SharedEventRing::Close()
+{
+#ifdef _WIN32
+	if (mWakeEvent)
+	{
+		CloseHandle(mWakeEvent);
+		mWakeEvent = nullptr;
+	}
+#endif
+	mMemory.Close();
+	mHeader = nullptr;
+}
+
+inline bool SharedEventRing::Attach(bool created)
+{
+#ifdef _WIN32
+	auto eventName = "Local\\" + mName + "_wake";
+	mWakeEvent = created
+		? CreateEventA(nullptr, FALSE, FALSE, eventName.c_str())
+		: OpenEventA(EVENT_MODIFY_STATE | SYNCHRONIZE, FALSE, eventName.c_str());
+	return mWakeEvent != nullptr;
+#else
+	(void)created;
+	return true;
+#endif
+}
+
+inline bool SharedEventRing::Post(uint32_t instance, uint32_t event, const void* payload, uint32_t payloadSize)
+{
+	if (!mHeader || payloadSize > mHeader->maxPayloadSize)
+	{
+		return false;
+	}
+
+	Cell* cell;
+	uint64_t pos = mHeader->enqueuePos.load(std::memory_order_relaxed);
+	for (;;)
+	{
+		cell = &CellAt(pos);
+		uint64_t seq = cell->sequence.load(std::memory_order_acquire);
+		int64_t diff = int64_t(seq) - int64_t(pos);
+		if (diff == 0)
+		{
+			if (mHeader->enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+			{
+				break;
+			}
+		}
+		else if (diff < 0)
+		{
+			return false; // full
+		}
+		else
+		{
+			pos = mHeader->enqueuePos.load(std::memory_order_relaxed);
+		}
+	}
+	cell->instance = instance;
+	cell->event = event;
+	cell->payloadSize = payloadSize;
+	if (payloadSize > 0)
+	{
+		std::memcpy(reinterpret_cast<char*>(cell + 1), payload, payloadSize);
+	}
+	cell->sequence.store(pos + 1, std::memory_order_release);
+
+	// pairs with the fence in Wait, so either we see the consumer sleeping,
+	// or it sees this record
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (mHeader->sleeping.load(std::memory_order_relaxed))
+	{
+		Wake();
+	}
+	return true;
+}
+
+template<typename Consumer>
+size_t SharedEventRing::Consume(Consumer&& consumer, size_t maxRecords)
+{
+	size_t count = 0;
+	if (!mHeader)
+	{
+		return count;
+	}
+	uint64_t pos = mHeader->dequeuePos.load(std::memory_order_relaxed);
+	while (count < maxRecords)
+	{
+		auto& cell = CellAt(pos);
+		if (cell.sequence.load(std::memory_order_acquire) != pos + 1)
+		{
+			break; // empty, or the next record is not published yet
+		}
+		IngressRecord record{ cell.instance, cell.event, RawPayload{ &cell + 1, cell.payloadSize } };
+		consumer(static_cast<const IngressRecord&>(record));
+		cell.sequence.store(pos + mHeader->capacity, std::memory_order_release);
+		++pos;
+		++count;
+	}
+	mHeader->dequeuePos.store(pos, std::memory_order_relaxed);
+	return count;
+}
+
+inline bool SharedEventRing::Empty() const
+{
+	if (!mHeader)
+	{
+		return true;
+	}
+	auto pos = mHeader->dequeuePos.load(std::memory_order_relaxed);
+	return CellAt(pos).sequence.load(std::memory_order_acquire) != pos + 1;
+}
+
+inline bool SharedEventRing::Wait(uint32_t timeoutMilliseconds)
+{
+	if (!mHeader)
+	{
+		return false;
+	}
+	auto wakeSequence = mHeader->wakeSequence.load(std::memory_order_acquire);
+	if (!Empty())
+	{
+		return true;
+	}
+
+	mHeader->sleeping.store(1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (Empty())
+	{
+#if defined(__linux__)
+		timespec timeout{ time_t(timeoutMilliseconds / 1000), long(timeoutMilliseconds % 1000) * 1000000 };
+		syscall(SYS_futex, &mHeader->wakeSequence, FUTEX_WAIT, wakeSequence, &timeout, nullptr, 0);
+#elif defined(_WIN32)
+		(void)wakeSequence;
+		WaitForSingleObject(mWakeEvent, timeoutMilliseconds);
+#else
+		(void)wakeSequence;
+		std::this_thread::sleep_for(std::chrono::milliseconds(std::min<uint32_t>(timeoutMilliseconds, 1)));
+#endif
+	}
+	mHeader->sleeping.store(0, std::memory_order_relaxed);
+	return !Empty();
+}
+
+inline void SharedEventRing::Wake()
+{
+	mHeader->wakeSequence.fetch_add(1, std::memory_order_release);
+#if defined(__linux__)
+	syscall(SYS_futex, &mHeader->wakeSequence, FUTEX_WAKE, 1, nullptr, nullptr, 0);
+#elif defined(_WIN32)
+	SetEvent(mWakeEvent);
+#endif
+}
+
+} // namespace LeanHsm
@@ -0,0 +1,206 @@
+// Copyright 2016, Jason Conaway
+// SharedMemory maps a named memory segment that several processes can map
+// at the same time. Data in a segment must not contain pointers, because
+// each process may map the segment at a different address; use offsets
+// and indices instead.
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace LeanHsm
+{
+
+class SharedMemory
+{
+public:
+	enum class Access { ReadOnly, ReadWrite };
+
+	SharedMemory() = default;
+	~SharedMemory() { Close(); }
+
+	SharedMemory(const SharedMemory&) = delete;
+	SharedMemory& operator=(const SharedMemory&) = delete;
+
+	// Creates (or replaces) a zero-filled segment. Returns false on failure.
+	bool Create(const std::string& name, size_t size);
+
+	// Maps an existing segment. Returns false on failure.
+	bool Open(const std::string& name, Access access);
+
+	// Unmaps the segment. The creator also removes the segment's name, so
+	// that no new processes can open it; existing mappings stay valid.
+	void Close();
+
+	void* Data() const { return mData; }
+	size_t Size() const { return mSize; }
+	bool IsOpen() const { return mData != nullptr; }
+
+private:
+	void* mData{ nullptr };
+	size_t mSize{ 0 };
+	bool mOwner{ false };
+	std::string mName;
+#ifdef _WIN32
+	HANDLE mMapping{ nullptr };
+#endif
+};
+
+///////////////////////////////////////////////////////////////////////////
+// SharedMemory implementation
+
+#ifdef _WIN32
+
+inline bool SharedMemory::Create(const std::string& name, size_t size)
+{
+	Close();
+	auto mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE,
+		DWORD(uint64_t(size) >> 32), DWORD(size), ("Local\\" + name).c_str());
+	if (!mapping)
+	{
+		return false;
+	}
+	auto data = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+	if (!data)
+	{
+		CloseHandle(mapping);
+		return false;
+	}
+	mMapping = mapping;
+	mData = data;
+	mSize = size;
+	mOwner = true;
+	mName = name;
+	return true;
+}
+
+inline bool SharedMemory::Open(const std::string& name, Access access)
+{
+	Close();
+	DWORD desiredAccess = access == Access::ReadOnly ? FILE_MAP_READ : FILE_MAP_ALL_ACCESS;
+	auto mapping = OpenFileMappingA(desiredAccess, FALSE, ("Local\\" + name).c_str());
+	if (!mapping)
+	{
+		return false;
+	}
+	auto data = MapViewOfFile(mapping, desiredAccess, 0, 0, 0);
+	MEMORY_BASIC_INFORMATION info;
+	if (!data || !VirtualQuery(data, &info, sizeof(info)))
+	{
+		if (data)
+		{
+			UnmapViewOfFile(data);
+		}
+		CloseHandle(mapping);
+		return false;
+	}
+	mMapping = mapping;
+	mData = data;
+	mSize = info.RegionSize;
+	mOwner = false;
+	mName = name;
+	return true;
+}
+
+inline void SharedMemory::Close()
+{
+	if (mData)
+	{
+		UnmapViewOfFile(mData);
+		CloseHandle(mMapping);
+		mData = nullptr;
+		mMapping = nullptr;
+		mSize = 0;
+		mOwner = false;
+	}
+}
+
+#else
+
+inline bool SharedMemory::Create(const std::string& name, size_t size)
+{
+	Close();
+	auto path = "/" + name;
+	shm_unlink(path.c_str());
+	int fd = shm_open(path.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+	if (fd < 0)
+	{
+		return false;
+	}
+	void* data = MAP_FAILED;
+	if (ftruncate(fd, off_t(size)) == 0)
+	{
+		data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (data == MAP_FAILED)
+	{
+		shm_unlink(path.c_str());
+		return false;
+	}
+	mData = data;
+	mSize = size;
+	mOwner = true;
+	mName = name;
+	return true;
+}
+
+inline bool SharedMemory::Open(const std::string& name, Access access)
+{
+	Close();
+	auto path = "/" + name;
+	int fd = shm_open(path.c_str(), access == Access::ReadOnly ? O_RDONLY : O_RDWR, 0);
+	if (fd < 0)
+	{
+		return false;
+	}
+	struct stat info;
+	void* data = MAP_FAILED;
+	if (fstat(fd, &info) == 0 && info.st_size > 0)
+	{
+		int protection = access == Access::ReadOnly ? PROT_READ : PROT_READ | PROT_WRITE;
+		data = mmap(nullptr, size_t(info.st_size), protection, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (data == MAP_FAILED)
+	{
+		return false;
+	}
+	mData = data;
+	mSize = size_t(info.st_size);
+	mOwner = false;
+	mName = name;
+	return true;
+}
+
+inline void SharedMemory::Close()
+{
+	if (mData)
+	{
+		munmap(mData, mSize);
+		if (mOwner)
+		{
+			shm_unlink(("/" + mName).c_str());
+		}
+		mData = nullptr;
+		mSize = 0;
+		mOwner = false;
+	}
+}
+
+#endif
+
+} // namespace LeanHsm
@@ -0,0 +1,276 @@
+// Copyright 2016, Jason Conaway
+// SharedStatePool publishes the committed states of many state machines in
+// a shared memory segment, so that other processes can read them wait-free,
+// without serializing machine state every tick. One process owns the
+// machines and dispatches their events; it creates the pool and attaches
+// its machines. Other processes open a SharedStateView of the pool.
+//
+// The segment holds a copy of the state graph's tables (parent and subtree
+// indices, and names) and a state index for each instance. It contains no
+// pointers, so it can be mapped at any address. A reader that has the same
+// state definitions can check StateGraph::Fingerprint to convert indices
+// back to its own State objects with StateGraph::StateAt.
+//
+// An instance's slot holds a single state index, which doesn't say where a
+// state of a submachine is placed, so graphs with submachines (see
+// StateGraph::HasSubmachines) can't be published.
+//
+// USAGE (owner):
+// LeanHsm::SharedStatePool<Door::Event> pool(graph);
+// pool.Create("doors", 1000);
+// pool.Attach(id, door.GetStateMachine());
+//
+// USAGE (reader):
+// LeanHsm::SharedStateView view;
+// view.Open("doors");
+// bool locked = view.IsInState(id, graph.IndexOf(Door::Locked));
+#pragma once
+
+#include "SharedMemory.h"
+#include "StateGraph.h"
+#include "StateMachine.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace LeanHsm
+{
+
+// Layout of a shared state pool segment
+struct SharedStateLayout
+{
+	enum : uint32_t { Magic = 0x4C48534Du }; // "LHSM"
+	enum : uint32_t { Version = 1 };
+	enum : size_t { NameLength = 32 };
+
+	struct Header
+	{
+		std::atomic<uint32_t> magic; // set last, once the segment is ready
+		uint32_t version;
+		uint64_t fingerprint;
+		uint32_t stateCount;
+		uint32_t instanceCapacity;
+		std::atomic<uint32_t> instanceCount;
+		uint32_t statesOffset;
+		uint32_t instancesOffset;
+	};
+
+	struct StateEntry
+	{
+		uint32_t parent;
+		uint32_t subtreeEnd;
+		char name[NameLength];
+	};
+
+	static size_t StatesOffset() { return (sizeof(Header) + 7) / 8 * 8; }
+	static size_t InstancesOffset(uint32_t stateCount)
+	{
+		return StatesOffset() + stateCount * sizeof(StateEntry);
+	}
+	static size_t Size(uint32_t stateCount, uint32_t instanceCapacity)
+	{
+		return InstancesOffset(stateCount) + instanceCapacity * sizeof(std::atomic<uint32_t>);
+	}
+};
+
+template<typename EventType>
+class SharedStatePool
+{
+public:
+	using Hsm = StateMachine<EventType>;
+	using Graph = StateGraph<EventType>;
+
+	explicit SharedStatePool(const Graph& graph) : mGraph(graph) {}
+
+	~SharedStatePool()
+	{
+		for (auto& attached : mAttached)
+		{
+			attached.first->RemoveCommitHook(attached.second);
+		}
+	}
+
+	SharedStatePool(const SharedStatePool&) = delete;
+	SharedStatePool& operator=(const SharedStatePool&) = delete;
+
+	// Creates the segment, with room for instanceCapacity instances.
+	// Returns false if the segment could not be created.
+	bool Create(const std::string& name, uint32_t instanceCapacity);
+
+	// Publishes the machine's committed state in the instance's slot, now and
+	// after each transition, until it is detached or the pool is destroyed.
+	// Returns false if the instance is out of range, or the graph has
+	// submachines. The machine must outlive the attachment.
+	bool Attach(uint32_t instance, Hsm& sm);
+
+	// Stops publishing the machine's state. Its slot keeps the last state.
+	void Detach(Hsm& sm);
+
+	uint32_t InstanceCapacity() const { return mHeader ? mHeader->instanceCapacity : 0; }
+
+private:
+	void Publish(uint32_t instance, uint32_t stateIndex)
+	{
+		mInstances[instance].store(stateIndex, std::memory_order_release);
+	}
+
+	const Graph& mGraph;
+	SharedMemory mMemory;
+	SharedStateLayout::Header* mHeader{ nullptr };
+	std::atomic<uint32_t>* mInstances{ nullptr };
+	std::vector<std::pair<Hsm*, typename Hsm::CommitHookId>> mAttached;
+};
+
+// SharedStateView reads a SharedStatePool, usually from another process.
+// All of its queries are wait-free.
+class SharedStateView
+{
+public:
+	enum : uint32_t { InvalidIndex = ~0u };
+
+	// Maps the pool's segment. Returns false if it does not exist, or is
+	// not a shared state pool.
+	bool Open(const std::string& name);
+
+	uint64_t Fingerprint() const { return mHeader->fingerprint; }
+	uint32_t StateCount() const { return mHeader->stateCount; }
+	const char* StateName(uint32_t stateIndex) const { return mStates[stateIndex].name; }
+
+	// Returns the number of instances that have been attached so far
+	uint32_t InstanceCount() const { return mHeader->instanceCount.load(std::memory_order_acquire); }
+
+	// Returns the index of the instance's committed state, or InvalidIndex
+	// if it has no state in the graph.
+	uint32_t StateIndexOf(uint32_t instance) const
+	{
+		return mInstances[instance].load(std::memory_order_acquire);
+	}
+
+	// Returns true if the instance is in the state, or one of its substates.
+	bool IsInState(uint32_t instance, uint32_t stateIndex) const
+	{
+		auto i = StateIndexOf(instance);
+		return i != InvalidIndex && i >= stateIndex && i < mStates[stateIndex].subtreeEnd;
+	}
+
+private:
+	SharedMemory mMemory;
+	const SharedStateLayout::Header* mHeader{ nullptr };
+	const SharedStateLayout::StateEntry* mStates{ nullptr };
+	const std::atomic<uint32_t>* mInstances{ nullptr };
+};
+
+///////////////////////////////////////////////////////////////////////////
+// SharedStatePool implementation
+
+template<typename EventType>
+bool SharedStatePool<EventType>::Create(const std::string& name, uint32_t instanceCapacity)
+{
+	using Layout = SharedStateLayout;
+	auto stateCount = mGraph.StateCount();
+	if (!mMemory.Create(name, Layout::Size(stateCount, instanceCapacity)))
+	{
+		return false;
+	}
+
+	auto base = static_cast<char*>(mMemory.Data());
+	auto states = reinterpret_cast<Layout::StateEntry*>(base + Layout::StatesOffset());
+	for (uint32_t i = 0; i < stateCount; ++i)
+	{
+		states[i].parent = mGraph.ParentOf(i);
+		states[i].subtreeEnd = mGraph.SubtreeEnd(i);
+		auto stateName = mGraph.StateAt(i).name;
+		std::strncpy(states[i].name, stateName ? stateName : "", Layout::NameLength - 1);
+	}
+
+	mInstances = reinterpret_cast<std::atomic<uint32_t>*>(base + Layout::InstancesOffset(stateCount));
+	for (uint32_t i = 0; i < instanceCapacity; ++i)
+	{
+		new (&mInstances[i]) std::atomic<uint32_t>(Graph::InvalidIndex);
+	}
+
+	// the header goes last; readers check the magic number
+	mHeader = new (base) Layout::Header;
+	mHeader->magic.store(0, std::memory_order_relaxed);
+	mHeader->version = Layout::Version;
+	mHeader->fingerprint = mGraph.Fingerprint();
+	mHeader->stateCount = stateCount;
+	mHeader->instanceCapacity = instanceCapacity;
+	mHeader->instanceCount.store(0, std::memory_order_relaxed);
+	mHeader->statesOffset = uint32_t(Layout::StatesOffset());
+	mHeader->instancesOffset = uint32_t(Layout::InstancesOffset(stateCount));
+	mHeader->magic.store(Layout::Magic, std::memory_order_release);
+	return true;
+}
+
+template<typename EventType>
+bool SharedStatePool<EventType>::Attach(uint32_t instance, Hsm& sm)
+{
+	if (!mHeader || instance >= mHeader->instanceCapacity || mGraph.HasSubmachines())
+	{
+		return false;
+	}
+
+	Publish(instance, mGraph.IndexOf(sm.CurrentStateSnapshot()));
+	auto hook = sm.AddCommitHook([this, instance](Hsm&, const typename Hsm::Commit& c) {
+		if (c.from != c.to)
+		{
+			Publish(instance, mGraph.IndexOf(*c.to));
+		}
+	});
+	mAttached.emplace_back(&sm, hook);
+
+	auto count = mHeader->instanceCount.load(std::memory_order_relaxed);
+	while (count <= instance &&
+		!mHeader->instanceCount.compare_exchange_weak(count, instance + 1, std::memory_order_release))
+	{
+	}
+	return true;
+}
+
+template<typename EventType>
+void SharedStatePool<EventType>::Detach(Hsm& sm)
+{
+	auto attached = std::find_if(mAttached.begin(), mAttached.end(),
+		[&sm](const std::pair<Hsm*, typename Hsm::CommitHookId>& a) { return a.first == &sm; });
+	if (attached != mAttached.end())
+	{
+		sm.RemoveCommitHook(attached->second);
+		mAttached.erase(attached);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// SharedStateView implementation
+
+inline bool SharedStateView::Open(const std::string& name)
+{
+	using Layout = SharedStateLayout;
+	if (!mMemory.Open(name, SharedMemory::Access::ReadOnly) || mMemory.Size() < sizeof(Layout::Header))
+	{
+		return false;
+	}
+
+	auto base = static_cast<const char*>(mMemory.Data());
+	auto header = reinterpret_cast<const Layout::Header*>(base);
+	if (header->magic.load(std::memory_order_acquire) != Layout::Magic || header->version != Layout::Version ||
+		mMemory.Size() < Layout::Size(header->stateCount, header->instanceCapacity))
+	{
+		mMemory.Close();
+		return false;
+	}
+
+	mHeader = header;
+	mStates = reinterpret_cast<const Layout::StateEntry*>(base + header->statesOffset);
+	mInstances = reinterpret_cast<const std::atomic<uint32_t>*>(base + header->instancesOffset);
+	return true;
+}
+
+} // namespace LeanHsm
@@ -0,0 +1,125 @@
+// Copyright 2016, Jason Conaway
+// SignalInbox receives events from contexts that must never block or
+// allocate, such as signal handlers, interrupt handlers, or callbacks on
+// threads owned by other libraries. Post only increments preallocated,
+// lock-free atomic counters (one per event), so it is async-signal-safe.
+// The events are later taken out by a normal thread, with Take, and fed into
+// the regular dispatch path.
+//
+// Events are taken in order of event index, not in the order they were
+// posted. SignalInbox requires dense events (see EventMask.h).
+#pragma once
+
+#include "EventMask.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#if ATOMIC_INT_LOCK_FREE != 2 || ATOMIC_LLONG_LOCK_FREE != 2
+#error "SignalInbox requires lock-free atomic integers"
+#endif
+
+namespace LeanHsm
+{
+
+template<typename EventType>
+class SignalInbox
+{
+public:
+	SignalInbox()
+	{
+		for (auto& count : mCounts)
+		{
+			count.store(0, std::memory_order_relaxed);
+		}
+		for (auto& word : mSummary)
+		{
+			word.store(0, std::memory_order_relaxed);
+		}
+	}
+
+	SignalInbox(const SignalInbox&) = delete;
+	SignalInbox& operator=(const SignalInbox&) = delete;
+
+	// Records an event. Async-signal-safe. Returns false if the event has
+	// no slot (i.e. its index is not below MaxEvents).
+	bool Post(const EventType& e)
+	{
+		auto i = EventIndex(e);
+		if (i >= MaxEvents)
+		{
+			return false;
+		}
+		mCounts[i].fetch_add(1, std::memory_order_relaxed);
+		mSummary[i / 64].fetch_or(uint64_t(1) << (i % 64), std::memory_order_release);
+		return true;
+	}
+
+	// Returns the number of recorded events. This is only a hint while
+	// events are being posted or taken.
+	size_t PendingCount() const
+	{
+		size_t count = 0;
+		for (auto& c : mCounts)
+		{
+			count += c.load(std::memory_order_relaxed);
+		}
+		return count;
+	}
+
+	bool HasPending() const
+	{
+		for (auto& word : mSummary)
+		{
+			if (word.load(std::memory_order_acquire) != 0)
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Takes the recorded events, invoking consumer(event) once for each time
+	// it was posted, until the consumer returns false (e.g. because its queue
+	// is full). The refused event, and the events not taken yet, stay in the
+	// inbox for the next Take. Must not be called from a signal handler.
+	template<typename Consumer>
+	size_t Take(Consumer&& consumer)
+	{
+		size_t taken = 0;
+		for (size_t w = 0; w < SummaryWords; ++w)
+		{
+			// a post that races with this takes effect now, or on the next Take
+			auto bits = mSummary[w].exchange(0, std::memory_order_acquire);
+			for (size_t b = 0; b < 64 && (bits >> b) != 0; ++b)
+			{
+				if ((bits >> b) & 1)
+				{
+					auto i = w * 64 + b;
+					auto count = mCounts[i].exchange(0, std::memory_order_relaxed);
+					for (uint32_t n = 0; n < count; ++n)
+					{
+						if (!consumer(static_cast<EventType>(i)))
+						{
+							// put back the rest of this event, and this word's other events
+							mCounts[i].fetch_add(count - n, std::memory_order_relaxed);
+							mSummary[w].fetch_or(bits >> b << b, std::memory_order_release);
+							return taken + n;
+						}
+					}
+					taken += count;
+				}
+			}
+		}
+		return taken;
+	}
+
+private:
+	static const size_t SummaryWords = (MaxEvents + 63) / 64;
+
+	std::atomic<uint32_t> mCounts[MaxEvents];
+	std::atomic<uint64_t> mSummary[SummaryWords]; // a bit for each non-zero count
+};
+
+} // namespace LeanHsm
@@ -0,0 +1,719 @@
+// Copyright 2016, Jason Conaway
+// StateGraph is an indexed view of the state graph that is rooted at a
+// top state. It assigns each state a dense index, in depth-first order, so
+// that the descendants of a state occupy a contiguous range of indices.
+// Engines that manage many machines (e.g. Population) use these indices to
+// keep per-state tables instead of chasing State pointers.
+//
+// States are discovered by following parents, initial transitions,
+// transition targets and submachines, starting from the top state. Indices
+// are stable for a given set of state definitions.
+//
+// The graph also computes which states can reach which (as a bit matrix), and
+// the shortest event sequences between them, for planners that ask things
+// like "which events take this door from Locked to Opened?". These tables
+// grow with the square of the number of resting states, so they are built
+// on the first query, and only cover the states a machine can rest in. A state's
+// outgoing edges are the transitions it handles, including inherited ones,
+// and each edge leads to a state where the machine comes to rest after the
+// transition (following initial transitions and completion transitions).
+// Guards depend on the machine, so a transition whose guarded completions or
+// branches may or may not be taken has an edge to each state it may rest in.
+//
+// Submachines are indexed once, however many placements they have, so their
+// tables are shared. Their states' masks and edges only cover the submachine's
+// own transitions, since the placement's transitions depend on the machine
+// (see StateMachine::ParentOf). Entering a placement enters its submachine.
+//
+// Pseudostates are indexed like states, but machines never rest in them. The
+// graph follows each of their branches; NextState prefers the first unguarded
+// one, which is usually the 'else'.
+//
+// Static junctions and chains of pass-through states are collapsed (see
+// StateMachine.h). Machines bound to the graph go directly to the end of a
+// chain, which costs one transition instead of one per state in the chain.
+#pragma once
+
+#include "EventMask.h"
+#include "StateMachine.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace LeanHsm
+{
+
+template<typename EventType>
+class StateGraph
+{
+public:
+	using Hsm = StateMachine<EventType>;
+	using State = typename Hsm::State;
+
+	static const uint32_t InvalidIndex = ~0u;
+
+	// The reachability tables are computed on threadCount threads, when
+	// they're first needed.
+	explicit StateGraph(const State& topState, size_t threadCount = 1);
+
+	StateGraph(const StateGraph&) = delete;
+	StateGraph& operator=(const StateGraph&) = delete;
+
+	uint32_t StateCount() const { return uint32_t(mStates.size()); }
+
+	// Returns the index of the state, or InvalidIndex if it is not in this graph.
+	uint32_t IndexOf(const State& s) const
+	{
+		auto found = mIndices.find(&s);
+		return found != mIndices.end() ? found->second : InvalidIndex;
+	}
+
+	const State& StateAt(uint32_t i) const { return *mStates[i]; }
+
+	// Returns the index of the parent state, or InvalidIndex for the top state.
+	uint32_t ParentOf(uint32_t i) const { return mParents[i]; }
+
+	// The state at index 'i' and its descendants have indices in the
+	// range [i, SubtreeEnd(i)).
+	uint32_t SubtreeEnd(uint32_t i) const { return mSubtreeEnds[i]; }
+
+	// Returns a hash of the state names and hierarchy, in index order. Graphs
+	// built from the same state definitions (e.g. in different processes, or
+	// different builds) have the same indices if their fingerprints match.
+	uint64_t Fingerprint() const { return mFingerprint; }
+
+	// Returns true if state 'i' is the state 'ancestor' or one of its descendants.
+	bool IsInState(uint32_t i, uint32_t ancestor) const
+	{
+		return i >= ancestor && i < mSubtreeEnds[ancestor];
+	}
+
+	// Returns the events that state 'i' handles or defers, including the
+	// events that its ancestors handle or defer (see EventMask.h).
+	const EventMask& AcceptMask(uint32_t i) const { return mAcceptMasks[i]; }
+
+	// Returns the state at the end of the chain of pass-through states that
+	// starts at 's', or 's' if it is not a pass-through state.
+	const State* CollapsedTarget(const State& s) const
+	{
+		if (mCollapsed.empty())
+		{
+			return &s;
+		}
+		auto found = mCollapsed.find(&s);
+		return found != mCollapsed.end() ? found->second : &s;
+	}
+
+	// Returns true if any state of the graph is a submachine placement.
+	bool HasSubmachines() const { return mHasSubmachines; }
+
+	// Returns the distinct events that the graph's transitions handle,
+	// including the members of event sets. Wildcards only add the events
+	// that the graph's other transitions, deferrals and sets mention.
+	const std::vector<EventType>& Events() const { return mEvents; }
+
+	// Returns the index of the state where a machine in state 'from' comes to
+	// rest after handling the event, taking unguarded completions and branches
+	// where there are any, or InvalidIndex if it doesn't handle it. Where
+	// guards allow, the machine may rest elsewhere (see CanReach).
+	uint32_t NextState(uint32_t from, const EventType& e) const;
+
+	// Returns true if some sequence of events takes a machine from state
+	// 'from' to state 'to', if guards allow. Every state reaches itself, and
+	// only states that a machine can rest in reach others. O(1) once the
+	// tables are built.
+	bool CanReach(uint32_t from, uint32_t to) const;
+
+	// Gets a shortest sequence of events that takes a machine from state 'from'
+	// to state 'to', if guards allow. Returns false if there is none.
+	// O(path length) once the tables are built.
+	bool ShortestPath(uint32_t from, uint32_t to, std::vector<EventType>& events) const;
+
+private:
+	using EventSlot = uint16_t; // index into mEvents
+	using HopIndex = uint16_t;  // index into a state's edges
+	static const HopIndex NoHop = 0xffff;
+
+	// an edge from a state, on the event in a slot
+	struct Edge
+	{
+		EventSlot slot;
+		uint32_t to;
+	};
+
+	void ComputeEdges();
+	void AddEvent(const EventType& e);
+	void AddMembers(const EventMask& members, std::true_type);
+	void AddMembers(const EventMask&, std::false_type) {}
+	void ComputePaths() const;
+	void ComputePathsFrom(uint32_t source, std::vector<uint32_t>& queue) const;
+	void Resolve(uint32_t from, const State* target, std::vector<uint32_t>& outcomes,
+		std::vector<uint32_t>& marks, uint32_t generation) const;
+	void Enter(uint32_t from, const State* target, std::vector<uint32_t>& entered, uint32_t depth) const;
+	void CollapseChains();
+	uint32_t PassThroughTarget(uint32_t i) const;
+
+	void Enumerate(const State* s, uint32_t parent,
+		const std::unordered_map<const State*, std::vector<const State*>>& children);
+
+	std::vector<const State*> mStates;
+	std::vector<uint32_t> mParents;
+	std::vector<uint32_t> mSubtreeEnds;
+	std::unordered_map<const State*, uint32_t> mIndices;
+	uint64_t mFingerprint{ 0 };
+	bool mHasSubmachines{ false };
+	std::vector<EventMask> mAcceptMasks; // per state, includes ancestors
+	std::unordered_map<const State*, const State*> mCollapsed; // pass-through states to the ends of their chains
+
+	// reachability tables
+	std::vector<EventType> mEvents;
+	std::vector<uint32_t> mEdges;       // per state and event slot, the next state if no guard allows
+	std::vector<uint32_t> mEdgeStarts;  // per state, its first edge in mAdjacent
+	std::vector<Edge> mAdjacent;        // per state, every state that each event may lead to
+	std::vector<uint32_t> mRestIndices; // per state, its row in the path tables, or InvalidIndex
+	std::vector<uint32_t> mRestStates;  // per row, the state
+
+	// path tables, over resting states only
+	size_t mThreadCount{ 1 };
+	mutable std::once_flag mPathsComputed;
+	mutable size_t mRowWords{ 0 };
+	mutable std::vector<uint64_t> mReachable;   // per resting state, a row of bits
+	mutable std::vector<HopIndex> mFirstHops;   // per resting state pair, the first edge of a shortest path
+};
+
+///////////////////////////////////////////////////////////////////////////
+// StateGraph implementation
+
+template<typename EventType>
+const uint32_t StateGraph<EventType>::InvalidIndex;
+
+template<typename EventType>
+const typename StateGraph<EventType>::HopIndex StateGraph<EventType>::NoHop;
+
+template<typename EventType>
+StateGraph<EventType>::StateGraph(const State& topState, size_t threadCount)
+{
+	// discover states, and the children of each state
+	std::vector<const State*> discovered{ &topState };
+	std::unordered_set<const State*> seen{ &topState };
+	std::unordered_map<const State*, std::vector<const State*>> children;
+	auto discover = [&](const State* s) {
+		if (s && seen.insert(s).second)
+		{
+			discovered.push_back(s);
+		}
+	};
+	for (size_t i = 0; i < discovered.size(); ++i)
+	{
+		auto s = discovered[i];
+		discover(s->parent);
+		discover(s->initialTransition.target);
+		for (auto& t : s->transitions)
+		{
+			discover(t.target);
+		}
+		for (auto& t : s->completions) // including pseudostate branches
+		{
+			discover(t.target);
+		}
+		discover(s->submachine);
+		mHasSubmachines = mHasSubmachines || s->submachine;
+		if (s->parent)
+		{
+			children[s->parent].push_back(s);
+		}
+	}
+
+	// number the states depth first, so that each subtree is contiguous;
+	// each submachine is numbered once, after the top state's hierarchy
+	Enumerate(&topState, InvalidIndex, children);
+	for (auto s : discovered)
+	{
+		if (!s->parent && mIndices.find(s) == mIndices.end())
+		{
+			Enumerate(s, InvalidIndex, children);
+		}
+	}
+
+	// FNV-1a hash of each state's name and parent index
+	mFingerprint = 14695981039346656037ull;
+	auto hash = [this](uint8_t byte) { mFingerprint = (mFingerprint ^ byte) * 1099511628211ull; };
+	for (uint32_t i = 0; i < StateCount(); ++i)
+	{
+		for (auto c = mStates[i]->name; c && *c; ++c)
+		{
+			hash(uint8_t(*c));
+		}
+		hash(0);
+		for (int shift = 0; shift < 32; shift += 8)
+		{
+			hash(uint8_t(mParents[i] >> shift));
+		}
+	}
+
+	// parents come before their children, so their masks are already done
+	mAcceptMasks.resize(StateCount());
+	for (uint32_t i = 0; i < StateCount(); ++i)
+	{
+		if (mParents[i] != InvalidIndex)
+		{
+			mAcceptMasks[i] = mAcceptMasks[mParents[i]];
+		}
+		for (auto& t : mStates[i]->transitions)
+		{
+			mAcceptMasks[i] |= t.Events();
+		}
+		for (auto& e : mStates[i]->deferred)
+		{
+			if (EventIndex(e) < MaxEvents)
+			{
+				mAcceptMasks[i].set(EventIndex(e));
+			}
+		}
+	}
+
+	CollapseChains();
+	ComputeEdges();
+	mThreadCount = std::max<size_t>(threadCount, 1);
+}
+
+template<typename EventType>
+uint32_t StateGraph<EventType>::NextState(uint32_t from, const EventType& e) const
+{
+	auto found = std::find(mEvents.begin(), mEvents.end(), e);
+	if (from >= StateCount() || found == mEvents.end())
+	{
+		return InvalidIndex;
+	}
+	return mEdges[from * mEvents.size() + (found - mEvents.begin())];
+}
+
+template<typename EventType>
+bool StateGraph<EventType>::CanReach(uint32_t from, uint32_t to) const
+{
+	if (from == to)
+	{
+		return true;
+	}
+	if (from >= StateCount() || to >= StateCount())
+	{
+		return false;
+	}
+	auto row = mRestIndices[from];
+	auto column = mRestIndices[to];
+	if (row == InvalidIndex || column == InvalidIndex)
+	{
+		return false;
+	}
+	std::call_once(mPathsComputed, [this] { ComputePaths(); });
+	return (mReachable[row * mRowWords + column / 64] >> (column % 64)) & 1;
+}
+
+template<typename EventType>
+bool StateGraph<EventType>::ShortestPath(uint32_t from, uint32_t to, std::vector<EventType>& events) const
+{
+	events.clear();
+	if (from >= StateCount() || to >= StateCount() || !CanReach(from, to))
+	{
+		return false;
+	}
+	// each first hop starts a shortest path, so following them from each
+	// state along the way stays on a shortest path
+	auto r = size_t(mRestStates.size());
+	auto column = mRestIndices[to];
+	while (from != to)
+	{
+		auto& edge = mAdjacent[mEdgeStarts[from] + mFirstHops[mRestIndices[from] * r + column]];
+		events.push_back(mEvents[edge.slot]);
+		from = edge.to;
+	}
+	return true;
+}
+
+template<typename EventType>
+void StateGraph<EventType>::ComputeEdges()
+{
+	// event sets are expanded into their members, which then resolve like
+	// any other event, in declaration order. A wildcard (AnyEvent) only
+	// expands to the events that are known from exact transitions,
+	// deferrals and other sets, since not every index is an event.
+	EventMask members;
+	EventMask known;
+	bool wildcard = false;
+	for (auto s : mStates)
+	{
+		for (auto& t : s->transitions)
+		{
+			if (!t.onEventSet)
+			{
+				AddEvent(t.eventId);
+				known |= t.Events();
+			}
+			else if (t.eventSet.all())
+			{
+				wildcard = true;
+			}
+			else
+			{
+				members |= t.eventSet;
+			}
+		}
+		for (auto& e : s->deferred)
+		{
+			if (EventIndex(e) < MaxEvents)
+			{
+				known.set(EventIndex(e));
+			}
+		}
+	}
+	if (wildcard)
+	{
+		members |= known;
+	}
+	AddMembers(members, IsDenseEvent<EventType>());
+
+	mEdges.assign(mStates.size() * mEvents.size(), InvalidIndex);
+	mEdgeStarts.assign(1, 0);
+	std::vector<uint32_t> outcomes;
+	std::vector<uint32_t> marks(StateCount(), 0);
+	uint32_t generation = 0;
+	for (uint32_t i = 0; i < StateCount(); ++i)
+	{
+		for (size_t slot = 0; slot < mEvents.size(); ++slot)
+		{
+			auto t = Hsm::FindTransition(*mStates[i], mEvents[slot]);
+			if (!t)
+			{
+				continue;
+			}
+			outcomes.clear();
+			Resolve(i, t->target, outcomes, marks, ++generation);
+			if (!outcomes.empty())
+			{
+				mEdges[i * mEvents.size() + slot] = outcomes.front();
+			}
+			for (auto to : outcomes)
+			{
+				mAdjacent.push_back(Edge{ EventSlot(slot), to });
+			}
+		}
+		mEdgeStarts.push_back(uint32_t(mAdjacent.size()));
+	}
+
+	// machines rest where edges lead, and in states without initial
+	// transitions, such as leaves; only these get rows in the path tables
+	mRestIndices.assign(StateCount(), InvalidIndex);
+	for (auto& edge : mAdjacent)
+	{
+		mRestIndices[edge.to] = 0;
+	}
+	for (uint32_t i = 0; i < StateCount(); ++i)
+	{
+		auto s = mStates[i];
+		if (s->pseudostate == Hsm::Pseudostate::None && !s->initialTransition.target && !s->submachine)
+		{
+			mRestIndices[i] = 0;
+		}
+		if (mRestIndices[i] != InvalidIndex)
+		{
+			mRestIndices[i] = uint32_t(mRestStates.size());
+			mRestStates.push_back(i);
+		}
+	}
+}
+
+template<typename EventType>
+void StateGraph<EventType>::AddEvent(const EventType& e)
+{
+	if (std::find(mEvents.begin(), mEvents.end(), e) == mEvents.end())
+	{
+		mEvents.push_back(e);
+	}
+}
+
+template<typename EventType>
+void StateGraph<EventType>::AddMembers(const EventMask& members, std::true_type)
+{
+	for (size_t i = 0; i < MaxEvents; ++i)
+	{
+		if (members.test(i))
+		{
+			AddEvent(EventFromIndex<EventType>(i));
+		}
+	}
+}
+
+template<typename EventType>
+void StateGraph<EventType>::Resolve(uint32_t from, const State* target, std::vector<uint32_t>& outcomes,
+	std::vector<uint32_t>& marks, uint32_t generation) const
+{
+	// follow completion transitions, like StateMachine::Complete. Guards
+	// depend on the machine, so each guarded completion may be taken, and the
+	// machine may rest in the state unless an unguarded completion follows
+	// them. The first outcome is where it rests if no guard allows.
+	auto addOutcome = [&outcomes](uint32_t i) {
+		if (std::find(outcomes.begin(), outcomes.end(), i) == outcomes.end())
+		{
+			outcomes.push_back(i);
+		}
+	};
+	if (!target)
+	{
+		addOutcome(from); // internal transitions don't complete
+		return;
+	}
+
+	// marks are 2 * generation while a state's completions are being
+	// followed, and 2 * generation + 1 after
+	std::vector<uint32_t> entered;
+	Enter(from, target, entered, 0);
+	for (auto current : entered)
+	{
+		if (marks[current] == 2 * generation)
+		{
+			addOutcome(current); // a cycle; the machine stops at its step limit
+			continue;
+		}
+		if (marks[current] == 2 * generation + 1)
+		{
+			continue;
+		}
+		marks[current] = 2 * generation;
+		auto& completions = mStates[current]->completions;
+		auto fallback = std::find_if(completions.begin(), completions.end(),
+			[](const typename Hsm::Transition& c) { return !c.guard; });
+		if (fallback == completions.end())
+		{
+			addOutcome(current);
+		}
+		else
+		{
+			Resolve(current, fallback->target, outcomes, marks, generation);
+		}
+		for (auto c = completions.begin(); c != fallback; ++c)
+		{
+			Resolve(current, c->target, outcomes, marks, generation);
+		}
+		marks[current] = 2 * generation + 1;
+	}
+}
+
+template<typename EventType>
+void StateGraph<EventType>::Enter(uint32_t from, const State* target, std::vector<uint32_t>& entered,
+	uint32_t depth) const
+{
+	// mirrors StateMachine::DoTransition: a transition to the current state or
+	// one of its ancestors rests there; otherwise initial transitions are followed
+	auto current = from;
+	for (; target && depth <= StateCount(); ++depth)
+	{
+		auto t = IndexOf(*target);
+		if (t == InvalidIndex)
+		{
+			return;
+		}
+		if (target->pseudostate != Hsm::Pseudostate::None)
+		{
+			// any branch may be taken, the first unguarded one if no guard allows
+			auto& branches = target->completions;
+			auto fallback = std::find_if(branches.begin(), branches.end(),
+				[](const typename Hsm::Transition& b) { return !b.guard; });
+			if (fallback != branches.end() && fallback->target)
+			{
+				Enter(current, fallback->target, entered, depth + 1);
+			}
+			for (auto b = branches.begin(); b != fallback; ++b)
+			{
+				if (b->target)
+				{
+					Enter(current, b->target, entered, depth + 1);
+				}
+			}
+			return;
+		}
+		if (IsInState(current, t))
+		{
+			current = t;
+			break;
+		}
+		current = t;
+		target = mStates[t]->submachine ? mStates[t]->submachine : mStates[t]->initialTransition.target;
+	}
+	if (std::find(entered.begin(), entered.end(), current) == entered.end())
+	{
+		entered.push_back(current);
+	}
+}
+
+template<typename EventType>
+uint32_t StateGraph<EventType>::PassThroughTarget(uint32_t i) const
+{
+	// Entering a pass-through state and taking its completion transition is
+	// the same as going to the target directly, except for the state itself:
+	// it's a leaf without actions, its completion is unconditional, and the
+	// target is inside its parent, below states without actions
+	auto s = mStates[i];
+	auto parent = mParents[i];
+	if (s->pseudostate == Hsm::Pseudostate::Junction)
+	{
+		// junctions are resolved before exiting anything, so only the branch matters
+		if (s->completions.empty())
+		{
+			return InvalidIndex;
+		}
+		auto& branch = s->completions.front();
+		auto target = branch.target ? IndexOf(*branch.target) : InvalidIndex;
+		return !branch.guard && !branch.action && target != i ? target : InvalidIndex;
+	}
+	if (s->pseudostate != Hsm::Pseudostate::None || SubtreeEnd(i) != i + 1 || s->initialTransition.target ||
+		s->submachine || s->entry || s->exit ||
+		s->completions.empty() || parent == InvalidIndex)
+	{
+		return InvalidIndex;
+	}
+	auto& completion = s->completions.front();
+	auto target = completion.target ? IndexOf(*completion.target) : InvalidIndex;
+	if (completion.guard || completion.action || target == InvalidIndex ||
+		target == i || target == parent || !IsInState(target, parent))
+	{
+		return InvalidIndex;
+	}
+	for (auto a = mParents[target]; a != parent; a = mParents[a])
+	{
+		if (mStates[a]->entry || mStates[a]->exit)
+		{
+			return InvalidIndex;
+		}
+	}
+	return target;
+}
+
+template<typename EventType>
+void StateGraph<EventType>::CollapseChains()
+{
+	for (uint32_t i = 0; i < StateCount(); ++i)
+	{
+		auto end = PassThroughTarget(i);
+		if (end == InvalidIndex)
+		{
+			continue;
+		}
+		// follow the chain, unless it is a cycle
+		uint32_t steps = 0;
+		for (auto next = PassThroughTarget(end); next != InvalidIndex && steps <= StateCount(); next = PassThroughTarget(end), ++steps)
+		{
+			end = next;
+		}
+		if (steps <= StateCount())
+		{
+			mCollapsed[mStates[i]] = mStates[end];
+		}
+	}
+}
+
+template<typename EventType>
+void StateGraph<EventType>::ComputePaths() const
+{
+	// breadth-first search from every resting state, in parallel; each
+	// search only writes its own rows of the tables
+	auto r = mRestStates.size();
+	mRowWords = (r + 63) / 64;
+	mReachable.assign(r * mRowWords, 0);
+	mFirstHops.assign(r * r, NoHop);
+	auto threadCount = std::max<size_t>(std::min<size_t>(mThreadCount, r), 1);
+	auto searchRange = [this, r, threadCount](size_t t) {
+		std::vector<uint32_t> queue;
+		for (auto row = r * t / threadCount; row < r * (t + 1) / threadCount; ++row)
+		{
+			ComputePathsFrom(uint32_t(row), queue);
+		}
+	};
+	std::vector<std::thread> threads;
+	for (size_t t = 1; t < threadCount; ++t)
+	{
+		threads.emplace_back(searchRange, t);
+	}
+	searchRange(0);
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+}
+
+template<typename EventType>
+void StateGraph<EventType>::ComputePathsFrom(uint32_t source, std::vector<uint32_t>& queue) const
+{
+	// every edge leads to a resting state, so the search never leaves them
+	auto r = mRestStates.size();
+	auto reachable = &mReachable[source * mRowWords];
+	auto firstHops = &mFirstHops[source * r];
+	auto sourceState = mRestStates[source];
+
+	queue.clear();
+	queue.push_back(sourceState);
+	for (size_t head = 0; head < queue.size(); ++head)
+	{
+		auto s = queue[head];
+		for (auto e = mEdgeStarts[s]; e < mEdgeStarts[s + 1]; ++e)
+		{
+			auto next = mAdjacent[e].to;
+			auto column = mRestIndices[next];
+			if (next == sourceState || firstHops[column] != NoHop)
+			{
+				continue;
+			}
+			firstHops[column] = s == sourceState ?
+				HopIndex(e - mEdgeStarts[sourceState]) : firstHops[mRestIndices[s]];
+			reachable[column / 64] |= uint64_t(1) << (column % 64);
+			queue.push_back(next);
+		}
+	}
+}
+
+template<typename EventType>
+void StateGraph<EventType>::Enumerate(const State* s, uint32_t parent,
+	const std::unordered_map<const State*, std::vector<const State*>>& children)
+{
+	auto index = uint32_t(mStates.size());
+	mStates.push_back(s);
+	mParents.push_back(parent);
+	mSubtreeEnds.push_back(InvalidIndex);
+	mIndices[s] = index;
+
+	auto found = children.find(s);
+	if (found != children.end())
+	{
+		for (auto child : found->second)
+		{
+			Enumerate(child, index, children);
+		}
+	}
+
+	mSubtreeEnds[index] = uint32_t(mStates.size());
+}
+
+///////////////////////////////////////////////////////////////////////////
+// StateMachine's graph binding
+
+template<typename EventType>
+void StateMachine<EventType>::BindGraph(const StateGraph<EventType>* graph)
+{
+	mBinding = GraphBinding();
+	if (graph)
+	{
+		mBinding.graph = graph;
+		mBinding.acceptMasks = graph->StateCount() > 0 ? &graph->AcceptMask(0) : nullptr;
+		mBinding.stateCount = graph->StateCount();
+		mBinding.indexOf = [](const StateGraph<EventType>& g, const State& s) { return g.IndexOf(s); };
+		mBinding.collapsedTarget = [](const StateGraph<EventType>& g, const State& s) { return g.CollapsedTarget(s); };
+	}
+	mStateIndex.store(graph && mCurrentState ? graph->IndexOf(*mCurrentState) : ~0u, std::memory_order_relaxed);
+}
+
+} // namespace LeanHsm
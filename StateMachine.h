@@ -31,8 +31,50 @@
 //
 //     /** Internal state transitions; stay in the same state, and do an action. **/
 //     .Always(When(Event::Pull).Do(MoreStaticMethodOfOwner))
+//
+//     /** Transitions on a set of events, such as a category or a wildcard
+//         (see EventMask.h). Transitions are matched in declaration order. **/
+//     .Always(When(SomeCategoryOfEvents).Do(MoreStaticMethodOfOwner))
+//
+//     /** (optional) Events to keep for later, instead of handling them here. **/
+//     .Defer(Event::Push)
+//
+//     /** Completion transitions; taken as soon as this state is entered, if
+//         their guard (if any) allows. The first allowed one is taken. **/
+//     .Always(Then(SomeGuardOfOwner).Goto(YetAnotherState))
+//     .Always(Then().Goto(MyParentState))
+// };
+//
+// Transitions may also target pseudostates, which select among guarded
+// branches (declared like completion transitions) without ever being entered:
+//
+// const Owner::State Owner::SomeJunction {
+//     Junction("SomeJunction").Parent(MyParentState)
+//     .Always(Then(SomeGuardOfOwner).Goto(SomeState))
+//     .Always(Then().Goto(AnotherState)) /** else **/
 // };
 //
+// A Junction's guards are evaluated before any state is exited, and a Choice's
+// guards are evaluated after the exits and the incoming transition's action,
+// so they can depend on what the action did. The first allowed branch is taken,
+// and its action (if any) is invoked after the incoming transition's action.
+//
+// A state can be a placement of a reusable submachine: a hierarchy of states
+// whose top state has no parent, and which is shared by all of its placements.
+// Entering the placement enters the submachine's top state, instead of an
+// initial transition, and the placement acts as the parent of the top state:
+//
+// const Owner::State Owner::FrontDoor {
+//     Name("FrontDoor").Parent(MyParentState)
+//     .Submachine(SomeSharedTopState)
+//     .Always(When(Event::Leave).Goto(BackDoor))
+// };
+//
+// Each machine keeps a small stack of the placements that it is in
+// (LEAN_HSM_MAX_SUBMACHINE_DEPTH), without allocating. Transitions within a
+// submachine should only target its own states. States of a submachine are
+// restored with their placements by RestoreConfiguration, but not by Restore.
+//
 // When HandleEvent(event) is called on the state machine, the correct transition
 // will be performed from the current state to the transition's target state.
 //
@@ -46,14 +88,64 @@
 //    state is invoked, ending with (and including) the target state.
 // 4) If the state that owns this transition was not a descendant of the target
 //    state, then the initial transition of the target state is invoked.
+// 5) If the resulting state has a completion transition whose guard allows,
+//    then it is performed, in the same way; this repeats until the machine
+//    rests in a state without one. This applies to every transition with a
+//    target, even one back to the state it started from, but not to internal
+//    transitions.
+// 6) The resulting state is committed, and becomes visible to other threads
+//    via CurrentStateSnapshot and IsInStateSnapshot.
+//
+// StateGraph collapses junctions whose first branch is unguarded and without
+// an action, and chains of pass-through states: leaf states without
+// entry or exit actions, whose first completion transition is unguarded,
+// without an action, and stays within the state's parent. A machine bound to
+// the graph (see BindGraph) goes directly to the end of such a chain, unless
+// it has entry and exit actions for all states (see OnEntryAndExit).
+//
+// While replaying recorded events (see SetReplayMode), actions are either
+// skipped, or invoked with IsReplaying() returning true, so that they can
+// restore their owner's state without repeating external side effects.
+// Forks (see Fork) use the same modes for speculative execution.
+//
+// Deferred events are kept in a small per-machine buffer (LEAN_HSM_MAX_DEFERRED
+// events), without allocating, and are handled again, in the order they
+// arrived, as soon as the machine settles in a state that doesn't defer them.
+// A state's transition for an event overrides its ancestors' deferral of it,
+// and vice versa. Payloads are not deferred.
+//
+// Each machine keeps a hash of its active states (see ConfigurationHash), which
+// is updated as states are exited and entered. Machines in the same
+// configuration have the same hash, in every process built from the same state
+// definitions, so lockstep peers can compare hashes to detect desyncs.
 //
 #pragma once
 
+#include "CommandBuffer.h"
+#include "EventMask.h"
+#include "TypeTag.h"
+
 #include <algorithm>
+#include <atomic>
+#include <cstdint>
 #include <functional>
 #include <iterator>
+#include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
 #include <cstdarg>
+#include <cstdio>
+
+// The number of deferred events that each machine can hold
+#ifndef LEAN_HSM_MAX_DEFERRED
+#define LEAN_HSM_MAX_DEFERRED 4
+#endif
+
+// The number of nested submachine placements that each machine can be in
+#ifndef LEAN_HSM_MAX_SUBMACHINE_DEPTH
+#define LEAN_HSM_MAX_SUBMACHINE_DEPTH 4
+#endif
 
 // Owners of state machines should use this macro to define
 // aliases in their public scope. Then, they should have an
@@ -65,11 +157,19 @@
 	using State = Hsm::State; \
 	using Name = Hsm::Name; \
 	using StartIn = Hsm::StartIn; \
-	using When = Hsm::When;
+	using When = Hsm::When; \
+	using Then = Hsm::Then; \
+	using Junction = Hsm::Junction; \
+	using Choice = Hsm::Choice;
 
 namespace LeanHsm
 {
 
+template<typename EventType> class StateGraph;
+
+const size_t MaxDeferred = LEAN_HSM_MAX_DEFERRED;
+const size_t MaxSubmachineDepth = LEAN_HSM_MAX_SUBMACHINE_DEPTH;
+
 template<typename EventType>
 class StateMachine
 {
@@ -78,6 +178,9 @@ public:
 	struct Transition;
 	struct StartIn;
 	struct When;
+	struct Then;
+	struct Junction;
+	struct Choice;
 
 	using Event = EventType;
 	using Action = std::function<void(StateMachine& sm)>;
@@ -85,6 +188,12 @@ public:
 	using Guard = std::function<bool(StateMachine& sm)>;
 	using EventToString = std::function<std::string (EventType e)>;
 	using Log = std::function<void(const char* format, va_list args)>;
+	struct Commit;
+	using CommitHook = std::function<void(StateMachine& sm, const Commit& c)>;
+	using CommitHookId = uint32_t;
+
+	// Pseudostates are never entered; they only select among their branches.
+	enum class Pseudostate { None, Junction, Choice };
 
 	// States reference each other via Transitions and Parents to form
 	// a hierachical state graph. The StateMachine handles events to
@@ -98,18 +207,39 @@ public:
 		State OnExit(const Action& a) && { exit = a; return std::move(*this); }
 		State Initially(StartIn&& t) && { initialTransition = std::move(t);	return std::move(*this); }
 		State Always(When&& t) && { transitions.emplace_back(std::forward<Transition>(t)); return std::move(*this); }
+		State Always(Then&& t) && { completions.emplace_back(std::forward<Transition>(t)); return std::move(*this); }
+		State Defer(const EventType& e) && { deferred.push_back(e); return std::move(*this); }
+		State Submachine(const State& top) && { submachine = &top; return std::move(*this); }
 			
 		const char* name{ nullptr };
+		uint64_t key{ 0 }; // for configuration hashes; derived from the name
 		const State* parent{ nullptr };
 		Action entry{ nullptr };
 		Action exit{ nullptr };
 		StartIn initialTransition;
 		Transitions transitions;
+		Transitions completions; // or branches, for pseudostates
+		std::vector<EventType> deferred;
+		Pseudostate pseudostate{ Pseudostate::None };
+		const State* submachine{ nullptr }; // the top state of a shared hierarchy
 
 		State(State&&) = default;
 		State& operator=(State&&) = default;
 	protected:
-		explicit State(const char* n) : name(n) {} // For the Name type
+		explicit State(const char* n) : name(n), key(KeyOf(n)) {} // For the Name type
+	private:
+		static uint64_t KeyOf(const char* n)
+		{
+			// FNV-1a, then a finalizer so that similar names have unrelated keys
+			uint64_t h = 14695981039346656037ull;
+			for (; n && *n; ++n)
+			{
+				h = (h ^ uint8_t(*n)) * 1099511628211ull;
+			}
+			h = (h ^ (h >> 33)) * 0xff51afd7ed558ccdull;
+			h = (h ^ (h >> 33)) * 0xc4ceb9fe1a85ec53ull;
+			return h ^ (h >> 33);
+		}
 	};
 
 	// State definitions should begin with a named state
@@ -118,13 +248,37 @@ public:
 		explicit Name(const char* n) : State(n) {}
 	};
 
+	// Pseudostate definitions begin with Junction or Choice instead of Name
+	struct Junction : public State
+	{
+		explicit Junction(const char* n) : State(n) { this->pseudostate = Pseudostate::Junction; }
+	};
+	struct Choice : public State
+	{
+		explicit Choice(const char* n) : State(n) { this->pseudostate = Pseudostate::Choice; }
+	};
+
 	// Transition is a generic state transition.
 	// Use the StartIn and When derivations when defining states.
 	struct Transition
 	{
 		EventType eventId{};
+		EventMask eventSet;     // for transitions on a set of events
+		bool onEventSet{ false };
 		const State* target{ nullptr };
 		Action action{ nullptr };
+		Guard guard{ nullptr }; // for completion transitions
+
+		bool Matches(const EventType& e) const
+		{
+			return onEventSet ? EventIndex(e) < MaxEvents && eventSet.test(EventIndex(e)) : eventId == e;
+		}
+
+		// Returns the events that this transition matches (see EventMask.h)
+		EventMask Events() const
+		{
+			return onEventSet || EventIndex(eventId) >= MaxEvents ? eventSet : EventMask().set(EventIndex(eventId));
+		}
 
 		Transition(Transition&&) = default;
 		Transition& operator=(Transition&&) = default;
@@ -132,6 +286,10 @@ public:
 	protected:
 		explicit Transition(const State& s) : target(&s) {} // for the StartIn transition type
 		explicit Transition(const EventType& e) : eventId(e) {} // for the When transition type
+		explicit Transition(const EventMask& events) : eventSet(events), onEventSet(true)
+		{
+			static_assert(IsDenseEvent<EventType>::value, "Event sets require a dense event type (see EventMask.h)");
+		}
 	};
 
 	// StartIn is a used with State::Initially to create an intial transition
@@ -143,21 +301,107 @@ public:
 		StartIn Do(const Action& a) && { action = a; return std::move(*this); }
 	};
 
-	// When is used with State::Always to create a normal state transition
+	// When is used with State::Always to create a normal state transition.
+	// It takes an event, or a set of events (see EventSet, EventRange and
+	// AnyEvent). A state's transitions are matched in the order they are
+	// declared, so an event's own transition should precede its sets'.
 	struct When : public Transition
 	{
 		explicit When(const EventType& e) : Transition(e) {}
+		explicit When(const EventMask& events) : Transition(events) {}
 		// Use Goto for normal transitions. Omit it for internal transitions.
 		When Goto(const State& s) && { target = &s; return std::move(*this); }
 		// Use Do to specify transition actions. (Optional) 
 		When Do(const Action& a) && { action = a; return std::move(*this); }
 	};
 
+	// Then is used with State::Always to create a completion transition,
+	// which is taken as soon as the state is entered, if the guard allows.
+	// Omit the guard for an unconditional completion transition.
+	struct Then : public Transition
+	{
+		explicit Then(const Guard& g = nullptr) { this->guard = g; }
+		Then Goto(const State& s) && { this->target = &s; return std::move(*this); }
+		// Use Do to specify transition actions. (Optional)
+		Then Do(const Action& a) && { this->action = a; return std::move(*this); }
+	};
+
+	// ReplayMode controls how actions are invoked while events are replayed.
+	enum class ReplayMode
+	{
+		Off,               // not replaying; actions are invoked
+		SuppressActions,   // actions are skipped
+		ReplaySafeActions, // actions are invoked, and should check IsReplaying
+	};
+
+	// Configuration is the compact, copyable part of a machine's state.
+	// Saving and restoring it is how many machines are rewound cheaply.
+	struct Configuration
+	{
+		const State* state;
+		size_t deferredCount;
+		EventType deferred[MaxDeferred];
+		size_t placementCount;
+		const State* placements[MaxSubmachineDepth];
+
+		friend bool operator==(const Configuration& a, const Configuration& b)
+		{
+			return a.state == b.state &&
+				a.deferredCount == b.deferredCount &&
+				std::equal(a.deferred, a.deferred + a.deferredCount, b.deferred) &&
+				a.placementCount == b.placementCount &&
+				std::equal(a.placements, a.placements + a.placementCount, b.placements);
+		}
+		friend bool operator!=(const Configuration& a, const Configuration& b) { return !(a == b); }
+	};
+
+	// Commit describes a completed run-to-completion step, and is passed
+	// to commit hooks. The event is null for the initial transition.
+	// Internal transitions are committed with the same 'from' and 'to'.
+	struct Commit
+	{
+		const State* from;
+		const State* to;
+		const EventType* event;
+	};
+
+	// LogLine is a formatted log entry, kept in a log buffer (see BindLogBuffer).
+	struct LogLine
+	{
+		const StateMachine* machine;
+		std::string text;
+	};
+
 	///////////////////////////////////////////////////////////////////////
 	// StateMachine methods
 
 	StateMachine(const State& topState, const Log& log, const EventToString& e2s)
-		: mCurrentState(&topState), mLog(log), mEventToString(e2s) {}
+		: mCurrentState(&topState), mCommittedState(&topState), mHash(HashOf(&topState)), mLog(log), mEventToString(e2s) {}
+
+	// Copies are forks. A fork starts in the same configuration, with the same
+	// owner and actions, but without commit hooks, bound commands or a payload,
+	// so that it can handle hypothetical events and then be discarded.
+	StateMachine(const StateMachine& other)
+		: mCurrentState(other.mCurrentState), mCommittedState(other.mCurrentState), mHash(other.mHash),
+		mOnEntry(other.mOnEntry), mOnExit(other.mOnExit),
+		mBinding(other.mBinding), mStateIndex(other.mStateIndex.load(std::memory_order_relaxed)), mOwner(other.mOwner),
+		mDeferredCount(other.mDeferredCount), mPlacementCount(other.mPlacementCount),
+		mCommittedDepth(other.mPlacementCount), mReplayMode(other.mReplayMode),
+		mLog(other.mLog), mEventToString(other.mEventToString)
+	{
+		std::copy(other.mDeferred, other.mDeferred + mDeferredCount, mDeferred);
+		std::copy(other.mPlacements, other.mPlacements + mPlacementCount, mPlacements);
+	}
+	StateMachine& operator=(const StateMachine&) = delete;
+
+	// Returns a fork whose actions run in the specified mode. A fork's actions
+	// act on the original owner, so by default they are suppressed.
+	StateMachine Fork(ReplayMode mode = ReplayMode::SuppressActions) const
+	{
+		StateMachine fork(*this);
+		fork.mReplayMode = mode;
+		return fork;
+	}
 		
 	// Specifies additional entry and exit actions for all states.
 	// These are invoked before state entry/exit actions.
@@ -166,15 +410,74 @@ public:
 		mOnEntry = entry;
 		mOnExit = exit; 
 	}
+
+	// Adds a hook that is invoked, on the dispatching thread, each time a
+	// transition is committed. Hooks are invoked in the order they were added.
+	// Returns an id for RemoveCommitHook.
+	CommitHookId AddCommitHook(const CommitHook& hook)
+	{
+		mCommitHooks.emplace_back(++mLastCommitHookId, hook);
+		return mLastCommitHookId;
+	}
+
+	// Removes a hook that AddCommitHook added. Objects whose hooks refer to
+	// themselves remove them when they are destroyed. Don't call from a hook.
+	void RemoveCommitHook(CommitHookId id)
+	{
+		mCommitHooks.erase(std::remove_if(mCommitHooks.begin(), mCommitHooks.end(),
+			[id](const std::pair<CommitHookId, CommitHook>& h) { return h.first == id; }), mCommitHooks.end());
+	}
 		
 	// Initializes the state machine by transitioning to the initial state.
 	void Initialize()
 	{
 		if (mCurrentState)
 		{
-			DoTransition(mCurrentState->initialTransition);
+			auto from = mCurrentState;
+			auto& initial = mCurrentState->initialTransition;
+			DoTransition(initial);
+			Complete(initial);
+			CommitTransition(from, nullptr);
 		}
 	}
+
+	// Sets the current state directly, without exiting or entering any states,
+	// and commits it (with a null event). This is for restoring machines from
+	// snapshots or journals, not for normal transitions. The machine leaves
+	// any submachine placements (see RestoreConfiguration).
+	void Restore(const State& s)
+	{
+		mPlacementCount = 0;
+		SetState(s);
+	}
+
+	// Saves the configuration, and restores a saved one, including the
+	// deferred events and submachine placements. Like Restore, restoring
+	// invokes no actions, and commits the restored state.
+	Configuration SaveConfiguration() const
+	{
+		Configuration c{};
+		c.state = mCurrentState;
+		c.deferredCount = mDeferredCount;
+		c.placementCount = mPlacementCount;
+		std::copy(mDeferred, mDeferred + mDeferredCount, c.deferred);
+		std::copy(mPlacements, mPlacements + mPlacementCount, c.placements);
+		return c;
+	}
+	void RestoreConfiguration(const Configuration& c)
+	{
+		mDeferredCount = c.deferredCount;
+		std::copy(c.deferred, c.deferred + c.deferredCount, mDeferred);
+		mPlacementCount = c.placementCount;
+		std::copy(c.placements, c.placements + c.placementCount, mPlacements);
+		SetState(*c.state);
+	}
+		
+	// Sets how actions are invoked while replaying events (or in a fork), or
+	// turns replay off. Info logging is also skipped while replaying.
+	void SetReplayMode(ReplayMode mode) { mReplayMode = mode; }
+	ReplayMode GetReplayMode() const { return mReplayMode; }
+	bool IsReplaying() const { return mReplayMode != ReplayMode::Off; }
 		
 	// Returns the current state
 	const State& CurrentState() const { return *mCurrentState; }
@@ -183,24 +486,211 @@ public:
 	// This includes ancestor states. Returns false, otherwise.
 	bool IsInState(const State& s) const;
 
+	// Returns the last committed state. Unlike CurrentState, this never
+	// observes the intermediate states that are visited while a transition
+	// is in progress. It is wait-free, and may be called from any thread
+	// while another thread is handling events.
+	const State& CurrentStateSnapshot() const { return *mCommittedState.load(std::memory_order_acquire); }
+
+	// Same as IsInState, but tests the last committed state.
+	// Like CurrentStateSnapshot, this may be called from any thread.
+	// Inside a submachine, this only sees the submachine's states.
+	bool IsInStateSnapshot(const State& s) const;
+
+	// Returns the parent of the state, or the placement of a submachine's
+	// top state, or null for the top state.
+	const State* ParentOf(const State* s) const;
+
+	// Returns the number of submachine placements that the machine is in.
+	size_t SubmachineDepth() const { return mPlacementCount; }
+
+	// Returns a submachine placement that the machine is in, from the
+	// outermost (depth 0) inward.
+	const State& PlacementAt(size_t depth) const { return *mPlacements[depth]; }
+
+	// Returns the hash of the active states: the XOR of the keys of the
+	// current state and its ancestors. It is updated incrementally, as states
+	// are exited and entered, so reading it is O(1).
+	uint64_t ConfigurationHash() const { return mHash; }
+
 	// Finds a state transition in the current state that is associated with
 	// this event, and performs the state transition. If matching transition
 	// was found, then this funtion returns true. Returns false, otherwise.
 	bool HandeleEvent(const EventType& e);
 
-	// Returns the owner object when this is an OwnedStateMachine.
+	// Same as HandeleEvent, but performs a transition that was already found
+	// with FindTransition(e), or with FindTransition(CurrentState(), e) outside
+	// of submachines. A null transition means that
+	// the event is not handled. This lets callers that dispatch the same event
+	// to many machines in the same state look up the transition only once.
+	bool HandleResolvedEvent(const EventType& e, const Transition* transition);
+
+	// Same as HandeleEvent, but for an event that carries a payload (see
+	// Payload.h). Actions can read the payload with EventPayload while the
+	// event is being handled. The payload type is a TypeTag. Deferred events
+	// don't keep payloads, so a state that defers the event drops it instead,
+	// with a warning, and this returns false.
+	bool HandleEventWithPayload(const EventType& e, const void* payload, const void* payloadType)
+	{
+		mPayload = payload;
+		mPayloadType = payloadType;
+		bool result = HandeleEvent(e);
+		mPayload = nullptr;
+		mPayloadType = nullptr;
+		return result;
+	}
+
+	// Returns the payload of the event being handled, if it is a T.
+	// Returns null if the event has no payload, or a payload of another type.
+	template<typename T>
+	const T* EventPayload() const
+	{
+		return mPayloadType == TypeTag<T>() ? static_cast<const T*>(mPayload) : nullptr;
+	}
+
+	// Binds the graph that this machine's states belong to (see StateGraph.h).
+	// The machine then keeps the graph index of its state as transitions are
+	// committed, which makes EnabledEvents and CanHandle O(1).
+	// Pass null to unbind. The graph must outlive the binding. Defined in
+	// StateGraph.h, so that machines without a graph don't need it.
+	void BindGraph(const StateGraph<EventType>* graph);
+
+	// Returns the events that the current state handles or defers, including
+	// those that its ancestors handle or defer (see EventMask.h). With a bound
+	// graph, this is the precomputed mask of the last committed state.
+	EventMask EnabledEvents() const;
+
+	// Returns true if the current state (or an ancestor) handles or defers
+	// the event, without handling it.
+	bool CanHandle(const EventType& e) const;
+
+	// Same as EnabledEvents, but for the last committed state. Like
+	// CurrentStateSnapshot, this may be called from any thread. Inside a
+	// submachine, this conservatively returns every event.
+	EventMask EnabledEventsSnapshot() const;
+
+	// Finds the transition for the event in the state or its ancestors.
+	// Returns null if there is no such transition, or if the event is
+	// deferred first (see Defers).
+	static const Transition* FindTransition(const State& s, const EventType& e);
+
+	// Returns true if the state or an ancestor defers the event, before
+	// reaching a state with a transition for it.
+	static bool Defers(const State& s, const EventType& e);
+
+	// Same as FindTransition(CurrentState(), e) and Defers(CurrentState(), e),
+	// but continue through the placements of the current submachines.
+	const Transition* FindTransition(const EventType& e) const;
+	bool Defers(const EventType& e) const;
+
+	// Returns the first completion transition of the state that its guard
+	// allows, or null if there is none.
+	const Transition* FindCompletion(const State& s);
+
+	// Returns the number of deferred events.
+	size_t DeferredCount() const { return mDeferredCount; }
+
+	// Returns the owner object when this is an OwnedStateMachine, or a fork of one.
 	// This is used by Actions that need a reference to their owner.
 	template<typename OwnerType> OwnerType& Owner() const;
 
+	// Binds a command buffer, so that actions can record commands with Emit
+	// instead of acting on shared systems directly. The instance id orders the
+	// commands when buffers are applied. Pass a null buffer to unbind.
+	template<typename CommandType>
+	void BindCommands(CommandBuffer<CommandType>* buffer, uint32_t instanceId)
+	{
+		mCommands = buffer;
+		mCommandType = TypeTag<CommandBuffer<CommandType>>();
+		mInstanceId = instanceId;
+	}
+
+	// Records a command in the bound command buffer. Returns false if no
+	// buffer for this type of command is bound, in which case the command is
+	// not moved from, and the action should perform the command itself.
+	template<typename CommandType>
+	bool Emit(CommandType&& command)
+	{
+		using Buffer = CommandBuffer<typename std::decay<CommandType>::type>;
+		if (!mCommands || mCommandType != TypeTag<Buffer>())
+		{
+			return false;
+		}
+		static_cast<Buffer*>(mCommands)->Push(mInstanceId, std::forward<CommandType>(command));
+		return true;
+	}
+
+	// Binds a log buffer, so that log entries are formatted into it instead of
+	// being logged, e.g. while machines are dispatched on several threads.
+	// Apply the buffers with CommandBuffer::ApplyInOrder and WriteLog, on one
+	// thread. Pass a null buffer to unbind.
+	void BindLogBuffer(CommandBuffer<LogLine>* buffer, uint32_t instanceId)
+	{
+		mLogLines = buffer;
+		mLogInstanceId = instanceId;
+	}
+
+	// Logs a buffered log entry with its machine's log.
+	static void WriteLog(const LogLine& line) { line.machine->LogText("%s", line.text.c_str()); }
+
+protected:
+	StateMachine(const State& topState, const Log& log, const EventToString& e2s, void* owner)
+		: StateMachine(topState, log, e2s) { mOwner = owner; }
+
 private:
 	std::vector<const State*> GetCommonAncestorPath(const State* a, const State* b) const;
 	bool DoTransition(const Transition& t);
+	std::vector<const State*> ExitToward(const State* target);
+	bool EnterSubmachine();
+	void SetState(const State& s);
+	void Invoke(const Action& action);
+	bool Defer(const EventType& e);
+	void Complete(const Transition& taken);
+	const State* Collapse(const State* target) const;
+	void RecallDeferred();
+	static const State* FindHandler(const State& s, const EventType& e, const Transition*& transition,
+		const StateMachine* placed = nullptr);
+	void CommitTransition(const State* from, const EventType* e);
+	static bool IsInLineage(const State* cs, const State& s, const StateMachine* placed = nullptr);
+	static uint64_t HashOf(const State* s);
+	EventMask MaskOf(const State* s, const StateMachine* placed = nullptr) const;
 	enum Severity { Info, Warning, Error };
 	void LogEntry(Severity severity, const char* format, ...);
+	void LogText(const char* format, ...) const;
 
 	const State* mCurrentState{ nullptr };
+	std::atomic<const State*> mCommittedState{ nullptr };
+	uint64_t mHash{ 0 };
 	Action mOnEntry;
 	Action mOnExit;
+	std::vector<std::pair<CommitHookId, CommitHook>> mCommitHooks;
+	CommitHookId mLastCommitHookId{ 0 };
+	// the bound graph's tables, and its queries, filled in by BindGraph
+	struct GraphBinding
+	{
+		const StateGraph<EventType>* graph{ nullptr };
+		const EventMask* acceptMasks{ nullptr }; // per state index
+		uint32_t stateCount{ 0 };
+		uint32_t (*indexOf)(const StateGraph<EventType>& graph, const State& s){ nullptr };
+		const State* (*collapsedTarget)(const StateGraph<EventType>& graph, const State& s){ nullptr };
+	};
+	GraphBinding mBinding;
+	std::atomic<uint32_t> mStateIndex{ ~0u }; // in the bound graph, of the committed state
+	void* mCommands{ nullptr };
+	const void* mCommandType{ nullptr };
+	uint32_t mInstanceId{ 0 };
+	CommandBuffer<LogLine>* mLogLines{ nullptr };
+	uint32_t mLogInstanceId{ 0 };
+	const void* mPayload{ nullptr };
+	const void* mPayloadType{ nullptr };
+	void* mOwner{ nullptr };
+	EventType mDeferred[MaxDeferred];
+	size_t mDeferredCount{ 0 };
+	const State* mPlacements[MaxSubmachineDepth]; // innermost last
+	size_t mPlacementCount{ 0 };
+	std::atomic<size_t> mCommittedDepth{ 0 };
+	bool mRecalling{ false };
+	ReplayMode mReplayMode{ ReplayMode::Off };
 	Log mLog;
 	EventToString mEventToString;
 };
@@ -212,7 +702,7 @@ class OwnedStateMachine : public StateMachine<EventType>
 {
 public:
 	OwnedStateMachine(OwnerType& owner, const State& topState, const Log& log, const EventToString& e2s)
-		: StateMachine(topState, log, e2s), mOwner(owner) {}
+		: StateMachine(topState, log, e2s, &owner), mOwner(owner) {}
 	OwnerType& GetOwner() const { return mOwner; }
 private:
 	OwnerType& mOwner;
@@ -225,8 +715,8 @@ template<typename EventType>
 template<typename OwnerType>
 OwnerType& StateMachine<EventType>::Owner() const
 {
-	using OHSM = OwnedStateMachine<OwnerType, EventType>;
-	return static_cast<const OHSM&>(*this).GetOwner();
+	// the owner is kept in the base, so that forks of owned machines have it too
+	return *static_cast<OwnerType*>(mOwner);
 }
 
 template<typename EventType>
@@ -238,12 +728,12 @@ std::vector<typename const StateMachine<EventType>::State*>
 	while (a)
 	{
 		aPath.push_back(a);
-		a = a->parent;
+		a = ParentOf(a);
 	}
 	while (b)
 	{
 		bPath.push_back(b);
-		b = b->parent;
+		b = ParentOf(b);
 	}
 	const State* ancestor{ nullptr };
 	while (!aPath.empty() && !bPath.empty() && aPath.back() == bPath.back())
@@ -267,28 +757,271 @@ bool StateMachine<EventType>::HandeleEvent(const EventType& e)
 		LogEntry(Error, "Cannot transition from a null state");
 		return false; 
 	}
-	auto state = mCurrentState;
+	return HandleResolvedEvent(e, FindTransition(e));
+}
+
+template<typename EventType>
+bool StateMachine<EventType>::HandleResolvedEvent(const EventType& e, const Transition* transition)
+{
+	if (!mCurrentState)
+	{
+		LogEntry(Error, "Cannot transition from a null state");
+		return false;
+	}
+	if (!transition)
+	{
+		if (Defers(e))
+		{
+			return Defer(e);
+		}
+		LogEntry(Warning, "No transition for event [%s] from %s",
+			mEventToString(e).c_str(), mCurrentState->name);
+		return false;
+	}
+
+	LogEntry(Info, "event [%s]", mEventToString(e).c_str());
+	auto from = mCurrentState;
+	bool result = DoTransition(*transition);
+	Complete(*transition);
+	CommitTransition(from, &e);
+	if (mDeferredCount > 0 && mCurrentState != from)
+	{
+		RecallDeferred();
+	}
+	return result;
+}
+
+template<typename EventType>
+void StateMachine<EventType>::Complete(const Transition& taken)
+{
+	// a loop, rather than recursion, so that long chains use no stack.
+	// Any transition with a target arrives at a state, even the state it
+	// left, so completions are checked; internal transitions arrive nowhere.
+	const size_t maxSteps = 64;
+	auto last = &taken;
+	for (size_t steps = 0; last->target; ++steps)
+	{
+		auto completion = FindCompletion(*mCurrentState);
+		if (!completion)
+		{
+			return;
+		}
+		if (steps == maxSteps)
+		{
+			LogEntry(Error, "Too many completion transitions; stopped in %s", mCurrentState->name);
+			return;
+		}
+		last = completion;
+		if (!DoTransition(*completion))
+		{
+			return;
+		}
+	}
+}
+
+template<typename EventType>
+const typename StateMachine<EventType>::Transition*
+	StateMachine<EventType>::FindCompletion(const State& s)
+{
+	for (auto& t : s.completions)
+	{
+		if (!t.guard || t.guard(*this))
+		{
+			return &t;
+		}
+	}
+	return nullptr;
+}
+
+template<typename EventType>
+const typename StateMachine<EventType>::State* StateMachine<EventType>::Collapse(const State* target) const
+{
+	// pass-through states have no actions, unless the machine has actions for all states
+	if (mBinding.graph && !mOnEntry && !mOnExit)
+	{
+		// transitions to an ancestor rest there, without initial transitions,
+		// so they can't go directly to the end of the chain
+		auto collapsed = mBinding.collapsedTarget(*mBinding.graph, *target);
+		return IsInLineage(mCurrentState, *collapsed, this) ? target : collapsed;
+	}
+	return target;
+}
+
+template<typename EventType>
+bool StateMachine<EventType>::Defer(const EventType& e)
+{
+	if (mDeferredCount == MaxDeferred)
+	{
+		LogEntry(Warning, "Too many deferred events; dropped event [%s] in %s",
+			mEventToString(e).c_str(), mCurrentState->name);
+		return false;
+	}
+	if (mPayload)
+	{
+		LogEntry(Warning, "Cannot defer an event with a payload; dropped event [%s] in %s",
+			mEventToString(e).c_str(), mCurrentState->name);
+		return false;
+	}
+	LogEntry(Info, "deferred event [%s]", mEventToString(e).c_str());
+	mDeferred[mDeferredCount++] = e;
+	return true;
+}
+
+template<typename EventType>
+void StateMachine<EventType>::RecallDeferred()
+{
+	// events handled here may change the state again; the outermost recall
+	// handles that by starting over, so the events stay in order
+	if (mRecalling)
+	{
+		return;
+	}
+	mRecalling = true;
+
+	// deferred events are kept without payloads, so recalled events must not
+	// see the payload of the event that recalled them
+	mPayload = nullptr;
+	mPayloadType = nullptr;
+	for (size_t i = 0; i < mDeferredCount; )
+	{
+		auto e = mDeferred[i];
+		if (Defers(e))
+		{
+			++i;
+			continue;
+		}
+		std::copy(mDeferred + i + 1, mDeferred + mDeferredCount, mDeferred + i);
+		--mDeferredCount;
+		auto before = mCurrentState;
+		HandeleEvent(e);
+		if (mCurrentState != before)
+		{
+			i = 0;
+		}
+	}
+	mRecalling = false;
+}
+
+template<typename EventType>
+const typename StateMachine<EventType>::Transition*
+	StateMachine<EventType>::FindTransition(const State& s, const EventType& e)
+{
+	const Transition* transition{ nullptr };
+	FindHandler(s, e, transition);
+	return transition;
+}
+
+template<typename EventType>
+bool StateMachine<EventType>::Defers(const State& s, const EventType& e)
+{
+	const Transition* transition{ nullptr };
+	return FindHandler(s, e, transition) && !transition;
+}
+
+template<typename EventType>
+const typename StateMachine<EventType>::Transition*
+	StateMachine<EventType>::FindTransition(const EventType& e) const
+{
+	const Transition* transition{ nullptr };
+	FindHandler(*mCurrentState, e, transition, this);
+	return transition;
+}
+
+template<typename EventType>
+bool StateMachine<EventType>::Defers(const EventType& e) const
+{
+	const Transition* transition{ nullptr };
+	return FindHandler(*mCurrentState, e, transition, this) && !transition;
+}
+
+template<typename EventType>
+const typename StateMachine<EventType>::State*
+	StateMachine<EventType>::FindHandler(const State& s, const EventType& e, const Transition*& transition,
+		const StateMachine* placed)
+{
+	// the innermost state with a transition for the event, or that defers it
+	auto state = &s;
 	while (state)
 	{
 		// find transition
-		auto transition = std::find_if(
+		auto found = std::find_if(
 			begin(state->transitions),
 			end(state->transitions),
-			[e](const Transition& t) { return t.eventId == e; });
-		if (transition != end(state->transitions))
-		{				
-			LogEntry(Info, "event [%s]", mEventToString(e).c_str());
-			return DoTransition(*transition);
+			[&e](const Transition& t) { return t.Matches(e); });
+		if (found != end(state->transitions))
+		{
+			transition = &*found;
+			return state;
+		}
+		else if (std::find(begin(state->deferred), end(state->deferred), e) != end(state->deferred))
+		{
+			transition = nullptr;
+			return state;
 		}
 		else
 		{
-			state = state->parent;
+			state = placed ? placed->ParentOf(state) : state->parent;
 		}
 	}
+	transition = nullptr;
+	return nullptr;
+}
 
-	LogEntry(Warning, "No transition for event [%s] from %s",
-		mEventToString(e).c_str(), mCurrentState->name);
-	return false;
+template<typename EventType>
+EventMask StateMachine<EventType>::EnabledEvents() const
+{
+	return MaskOf(mCurrentState, mPlacementCount > 0 ? this : nullptr);
+}
+
+template<typename EventType>
+EventMask StateMachine<EventType>::EnabledEventsSnapshot() const
+{
+	// the placements may be changing on another thread
+	if (mCommittedDepth.load(std::memory_order_acquire) > 0)
+	{
+		return AnyEvent();
+	}
+	return MaskOf(mCommittedState.load(std::memory_order_acquire));
+}
+
+template<typename EventType>
+EventMask StateMachine<EventType>::MaskOf(const State* state, const StateMachine* placed) const
+{
+	// the graph's masks of a submachine's states don't include their placements
+	auto index = mStateIndex.load(std::memory_order_relaxed);
+	if (index < mBinding.stateCount && !placed)
+	{
+		return mBinding.acceptMasks[index];
+	}
+	EventMask mask;
+	for (auto s = state; s; s = placed ? placed->ParentOf(s) : s->parent)
+	{
+		for (auto& t : s->transitions)
+		{
+			mask |= t.Events();
+		}
+		for (auto& e : s->deferred)
+		{
+			if (EventIndex(e) < MaxEvents)
+			{
+				mask.set(EventIndex(e));
+			}
+		}
+	}
+	return mask;
+}
+
+template<typename EventType>
+bool StateMachine<EventType>::CanHandle(const EventType& e) const
+{
+	auto i = EventIndex(e);
+	auto index = mStateIndex.load(std::memory_order_relaxed);
+	if (index < mBinding.stateCount && i < MaxEvents && mPlacementCount == 0)
+	{
+		return mBinding.acceptMasks[index].test(i);
+	}
+	const Transition* transition{ nullptr };
+	return mCurrentState && FindHandler(*mCurrentState, e, transition, this);
 }
 
 template<typename EventType>
@@ -305,35 +1038,50 @@ bool StateMachine<EventType>::DoTransition(const Transition& transition)
 	{
 		target = mCurrentState;
 	}
+	else if (!IsInLineage(mCurrentState, *target, this))
+	{
+		target = Collapse(target);
+	}
 	LogEntry(Info, "transition %s -> %s", mCurrentState->name, target->name);
 
-	// exit up to common ancestor
-	auto targetPath = GetCommonAncestorPath(mCurrentState, target);
-	if (!targetPath.empty())
+	// select junction branches before leaving the current state
+	const size_t maxJunctions = 8;
+	const Transition* junctionBranches[maxJunctions];
+	size_t junctionCount = 0;
+	while (target->pseudostate == Pseudostate::Junction)
 	{
-		auto ancestor = targetPath.back();
-		targetPath.pop_back();
-		while (mCurrentState != ancestor)
+		auto branch = FindCompletion(*target);
+		if (!branch || !branch->target || junctionCount == maxJunctions)
 		{
-			if (mOnExit)
-			{
-				mOnExit(*this);
-			}
-			if (mCurrentState->exit)
-			{
-				mCurrentState->exit(*this);
-			}
-			if (mCurrentState->parent)
-			{
-				mCurrentState = mCurrentState->parent;
-			}
+			LogEntry(Error, "No branch from junction %s", target->name);
+			return false;
 		}
-	}		
+		junctionBranches[junctionCount++] = branch;
+		target = branch->target;
+	}
+
+	// exit up to common ancestor
+	auto targetPath = ExitToward(target);
 
 	// do transition action
-	if (transition.action)
+	Invoke(transition.action);
+	for (size_t i = 0; i < junctionCount; ++i)
 	{
-		transition.action(*this);
+		Invoke(junctionBranches[i]->action);
+	}
+
+	// select choice branches after the actions, and exit further if needed
+	while (target->pseudostate != Pseudostate::None)
+	{
+		auto branch = FindCompletion(*target);
+		if (!branch || !branch->target)
+		{
+			LogEntry(Error, "No branch from %s; stopped in %s", target->name, mCurrentState->name);
+			return false;
+		}
+		target = branch->target;
+		targetPath = ExitToward(target);
+		Invoke(branch->action);
 	}
 
 	bool wasDescendantOfTarget = targetPath.empty();
@@ -343,17 +1091,17 @@ bool StateMachine<EventType>::DoTransition(const Transition& transition)
 	{
 		mCurrentState = targetPath.back();
 		targetPath.pop_back();
-		if (mOnEntry)
-		{
-			mOnEntry(*this);
-		}
-		if (mCurrentState->entry)
-		{
-			mCurrentState->entry(*this);
-		}
+		mHash ^= mCurrentState->key;
+		Invoke(mOnEntry);
+		Invoke(mCurrentState->entry);
 	}
 
-	if (!wasDescendantOfTarget && mCurrentState->initialTransition.target)
+	if (!wasDescendantOfTarget && mCurrentState->submachine)
+	{
+		// a placement enters its submachine instead of an initial transition
+		return EnterSubmachine();
+	}
+	else if (!wasDescendantOfTarget && mCurrentState->initialTransition.target)
 	{
 		// perform initial transition
 		return DoTransition(mCurrentState->initialTransition);
@@ -364,31 +1112,189 @@ bool StateMachine<EventType>::DoTransition(const Transition& transition)
 	}
 }
 
+template<typename EventType>
+bool StateMachine<EventType>::EnterSubmachine()
+{
+	if (mPlacementCount == MaxSubmachineDepth)
+	{
+		LogEntry(Error, "Too many nested submachines; stopped in %s", mCurrentState->name);
+		return false;
+	}
+	mPlacements[mPlacementCount++] = mCurrentState;
+	mCurrentState = mCurrentState->submachine;
+	mHash ^= mCurrentState->key;
+	Invoke(mOnEntry);
+	Invoke(mCurrentState->entry);
+	if (mCurrentState->initialTransition.target)
+	{
+		return DoTransition(mCurrentState->initialTransition);
+	}
+	return true;
+}
+
+template<typename EventType>
+void StateMachine<EventType>::SetState(const State& s)
+{
+	auto from = mCurrentState;
+	mCurrentState = &s;
+	mHash = 0;
+	for (auto a = mCurrentState; a; a = ParentOf(a))
+	{
+		mHash ^= a->key;
+	}
+	CommitTransition(from, nullptr);
+}
+
+template<typename EventType>
+const typename StateMachine<EventType>::State* StateMachine<EventType>::ParentOf(const State* s) const
+{
+	if (s->parent)
+	{
+		return s->parent;
+	}
+	// the innermost placement of the submachine
+	for (auto i = mPlacementCount; i > 0; --i)
+	{
+		if (mPlacements[i - 1]->submachine == s)
+		{
+			return mPlacements[i - 1];
+		}
+	}
+	return nullptr;
+}
+
+template<typename EventType>
+std::vector<typename const StateMachine<EventType>::State*>
+	StateMachine<EventType>::ExitToward(const State* target)
+{
+	// exits up to the common ancestor, and returns the path down to the target
+	auto targetPath = GetCommonAncestorPath(mCurrentState, target);
+	if (!targetPath.empty())
+	{
+		auto ancestor = targetPath.back();
+		targetPath.pop_back();
+		while (mCurrentState != ancestor)
+		{
+			Invoke(mOnExit);
+			Invoke(mCurrentState->exit);
+			auto parent = ParentOf(mCurrentState);
+			if (parent)
+			{
+				if (!mCurrentState->parent)
+				{
+					--mPlacementCount; // leaving a submachine
+				}
+				mHash ^= mCurrentState->key;
+				mCurrentState = parent;
+			}
+		}
+	}
+	return targetPath;
+}
+
+template<typename EventType>
+void StateMachine<EventType>::Invoke(const Action& action)
+{
+	if (action && mReplayMode != ReplayMode::SuppressActions)
+	{
+		action(*this);
+	}
+}
+
+template<typename EventType>
+void StateMachine<EventType>::CommitTransition(const State* from, const EventType* e)
+{
+	// publish the resulting state for readers on other threads
+	mCommittedState.store(mCurrentState, std::memory_order_release);
+	mCommittedDepth.store(mPlacementCount, std::memory_order_release);
+	if (mBinding.graph && mCurrentState != from)
+	{
+		mStateIndex.store(mBinding.indexOf(*mBinding.graph, *mCurrentState), std::memory_order_relaxed);
+	}
+
+	if (!mCommitHooks.empty())
+	{
+		const Commit commit{ from, mCurrentState, e };
+		for (auto& hook : mCommitHooks)
+		{
+			hook.second(*this, commit);
+		}
+	}
+}
+
 template<typename EventType>
 bool StateMachine<EventType>::IsInState(const State& s) const
 {
-	// check if 's' is in our current state's lineage
-	const State* cs = mCurrentState;
+	return IsInLineage(mCurrentState, s, this);
+}
+
+template<typename EventType>
+bool StateMachine<EventType>::IsInStateSnapshot(const State& s) const
+{
+	return IsInLineage(mCommittedState.load(std::memory_order_acquire), s);
+}
+
+template<typename EventType>
+bool StateMachine<EventType>::IsInLineage(const State* cs, const State& s, const StateMachine* placed)
+{
+	// check if 's' is in the lineage of state 'cs'
 	while (cs)
 	{
 		if (cs == &s)
 		{
 			return true;
 		}
-		cs = cs->parent;
+		cs = placed ? placed->ParentOf(cs) : cs->parent;
 	}
 
 	return false;
 }
 
+template<typename EventType>
+uint64_t StateMachine<EventType>::HashOf(const State* s)
+{
+	uint64_t hash = 0;
+	for (; s; s = s->parent)
+	{
+		hash ^= s->key;
+	}
+	return hash;
+}
+
 template<typename EventType>
 void StateMachine<EventType>::LogEntry(Severity severity, const char* format, ...)
 {
+	if (severity == Info && IsReplaying())
+	{
+		return;
+	}
 	const std::string severityLabels[] = { "","WARNING| ", "ERROR| " };
 	std::string decoratedFormat = severityLabels[severity] + format;
 	va_list args;
 	va_start(args, format);
-	mLog(decoratedFormat.c_str(), args);
+	if (mLogLines)
+	{
+		va_list sizing;
+		va_copy(sizing, args);
+		auto size = std::vsnprintf(nullptr, 0, decoratedFormat.c_str(), sizing);
+		va_end(sizing);
+		std::vector<char> text(size_t(std::max(size, 0)) + 1);
+		std::vsnprintf(text.data(), text.size(), decoratedFormat.c_str(), args);
+		mLogLines->Push(mLogInstanceId, LogLine{ this, text.data() });
+	}
+	else
+	{
+		mLog(decoratedFormat.c_str(), args);
+	}
+	va_end(args);
+}
+
+template<typename EventType>
+void StateMachine<EventType>::LogText(const char* format, ...) const
+{
+	va_list args;
+	va_start(args, format);
+	mLog(format, args);
 	va_end(args);
 }
 
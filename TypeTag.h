@@ -0,0 +1,17 @@
+// Copyright 2016, Jason Conaway
+// TypeTag<T>() returns a unique address for each type T. LeanHsm uses it to
+// check the type of data that is passed around as void pointers (commands
+// and event payloads), without requiring RTTI.
+#pragma once
+
+namespace LeanHsm
+{
+
+template<typename T>
+const void* TypeTag()
+{
+	static const char tag{};
+	return &tag;
+}
+
+} // namespace LeanHsm